@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chash.h"
+
+// MurmurHash3 finalizer: neighbouring keys land far apart on the ring
+static uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// FNV-1a of the name, so a server keeps its points whatever its position
+// in the server list
+static uint64_t
+hash_name(const char *name)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *name; name++)
+	{
+		h ^= (unsigned char)*name;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int
+point_cmp(const void *a, const void *b)
+{
+	const struct chash_point *pa = a, *pb = b;
+
+	if (pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return pa->server - pb->server;
+}
+
+void
+chash_init(struct chash *ch)
+{
+	memset(ch, 0, sizeof(*ch));
+}
+
+// Place server on the ring under name
+int
+chash_add(struct chash *ch, const char *name, int server)
+{
+	struct chash_point *points;
+	uint64_t h = hash_name(name);
+	int i;
+
+	points = realloc(ch->points, (ch->nr_points + CHASH_VNODES) * sizeof(*points));
+	if (!points)
+	{
+		perror("realloc");
+		return -1;
+	}
+	ch->points = points;
+	for (i = 0; i < CHASH_VNODES; i++)
+	{
+		points[ch->nr_points].hash = mix64(h + i);
+		points[ch->nr_points].server = server;
+		ch->nr_points++;
+	}
+	qsort(ch->points, ch->nr_points, sizeof(*points), point_cmp);
+	return 0;
+}
+
+// Index of the first point at or clockwise from the hash of key
+static int
+first_point(const struct chash *ch, uint64_t key)
+{
+	uint64_t h = mix64(key);
+	int lo = 0, hi = ch->nr_points;
+
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (ch->points[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo == ch->nr_points ? 0 : lo;
+}
+
+// Server owning key, or -1 on an empty ring
+int
+chash_lookup(const struct chash *ch, uint64_t key)
+{
+	if (!ch->nr_points)
+		return -1;
+	return ch->points[first_point(ch, key)].server;
+}
+
+// The first n distinct servers clockwise from key, owner first. Returns
+// how many were found, fewer than n if the ring has fewer servers.
+int
+chash_lookup_n(const struct chash *ch, uint64_t key, int *servers, int n)
+{
+	int found = 0, i, j, k;
+
+	if (!ch->nr_points)
+		return 0;
+	i = first_point(ch, key);
+	for (k = 0; k < ch->nr_points && found < n; k++, i = (i + 1) % ch->nr_points)
+	{
+		for (j = 0; j < found && servers[j] != ch->points[i].server; j++)
+			;
+		if (j == found)
+			servers[found++] = ch->points[i].server;
+	}
+	return found;
+}
+
+void
+chash_free(struct chash *ch)
+{
+	free(ch->points);
+	memset(ch, 0, sizeof(*ch));
+}
@@ -0,0 +1,30 @@
+#ifndef CHASH_H
+#define CHASH_H
+
+#include <stdint.h>
+
+#define CHASH_VNODES 64 // ring points per server
+
+// Consistent hash ring. Every server is placed at CHASH_VNODES points
+// derived from its name, and a key belongs to the server at the first point
+// clockwise from the key's hash. Adding one server to n takes over about
+// 1/(n+1) of the keys and leaves the placement of all others unchanged.
+struct chash_point
+{
+	uint64_t hash;
+	int server;
+};
+
+struct chash
+{
+	struct chash_point *points;
+	int nr_points;
+};
+
+void chash_init(struct chash *ch);
+int chash_add(struct chash *ch, const char *name, int server);
+int chash_lookup(const struct chash *ch, uint64_t key);
+int chash_lookup_n(const struct chash *ch, uint64_t key, int *servers, int n);
+void chash_free(struct chash *ch);
+
+#endif
@@ -7,67 +7,303 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <signal.h>
+#include <sys/signalfd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <time.h> // for clock_gettime
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h> // Add this line
+#include <getopt.h>
+#include <poll.h>
+#include "proto.h"
+#include "regmem.h"
+#include "hugealloc.h"
+#include "topology.h"
+#include "chash.h"
+#include "ec.h"
+#include "fault_queue.h"
 
 // Define constants -- client will always use 2MB for read from now on
-#define BUFFER_SIZE 2 * 1024 * 1024         // 2MB + 4KB
+#define BUFFER_SIZE (2 * 1024 * 1024)       // 2MB + 4KB
 #define EVICTION_SIZE (2 * 1024 * 1024 * 2) // 2MB + 4KB
 #define SET_BUFFER 0x12345678               // also sets PID as current
 #define FAULT_HANDLED 0x12345679
 #define REMOTE_PAGENUM 10
 #define REMOTE_SIZE (2 * 1024 * 1024 * REMOTE_PAGENUM)
+#define SUBPAGE_SIZE 4096 // smallest fetch unit
+#define SUBPAGES (BUFFER_SIZE / SUBPAGE_SIZE)
+#define DENSITY_WINDOW 64 // faults a page's density is measured over (-g auto)
 
 // fault queue
-#define DEVICE_NAME "/dev/fault_queue"
-#define QUEUE_SIZE 32
-struct fault_task
-{
-	void *fault_va;
-	int processed;
-};
-struct fault_queue
-{
-	struct fault_task buffer[QUEUE_SIZE];
-	volatile int head;
-	volatile int tail;
-};
 struct fault_queue *queue;
+struct fault_done_ring *done_ring;
+int queue_fd;
+const char *queue_path = DEVICE_NAME; // -q
+int next_task = -1; // next queue slot to handle, -1: start at tail
+uint64_t faults_done, done_notifies;
+// With the userspace stand-in for the driver (-q on its memfd) faults name
+// the remote page by their address, and the handoff is timed from the
+// producer's enqueue stamps
+struct fault_queue_emu *emu;
+uint64_t pickup_ns, handled_ns; // summed over faults_done
+
+// work request ids
+#define WR_READ 1
+#define WR_WRITE 2
+#define WR_CTRL_SEND 3
+#define WR_NOTIFY 4 // completions are not waited for
+#define WR_RECV 0x100 // | receive slot
+#define WR_WB 0x200   // | low bits of the writeback WR sequence number
+#define WR_BULK_RECV 0x300 // receive on the bulk QP
+#define WR_KIND(id) ((id) & ~0xffULL)
+#define WR_SLOT(id) ((int)((id) & 0xff))
+
+#define WB_SLOTS 4      // pages being written back at a time
+#define SIGNAL_EVERY 8  // signal at least every this many otherwise unsignaled WRs
+#define CTRL_INLINE 64  // max_inline_data asked for; control messages up to it skip the DMA read
+
+#define POST_MAX WB_SLOTS // WRs posted with one doorbell
 
 // #define PROFILE
 // #define PROFILE_READ
+// #define PROFILE_POST // CPU time of building and posting one-sided WRs
+// #define CLASSIC_POST // ibv_post_send even where ibv_wr_* works, to compare
 // #define EXIT
 #define UVM
 
+// Connection to one memory server. Each server holds the remote pages the
+// consistent hash ring assigns it, at the same offsets as in a one-server
+// setup, so a page that keeps its owner when servers are added or removed
+// also keeps its address.
+struct server
+{
+	char name[64]; // host:port; the one it started with is its key on the ring
+	struct sockaddr_in addr;
+	// While on the standby: the server it stands in for
+	int on_standby;
+	char home_name[64];
+	struct sockaddr_in home_addr;
+	struct rdma_cm_id *conn;
+	struct ibv_pd *pd;
+	struct ibv_cq *cq;
+	struct regmem staging; // buffer, registered in MR chunks in this PD
+	struct ibv_mr *ctrl_mr;
+	char *ctrl_buf; // CTRL_RECV_SLOTS receive slots, then one send slot
+	uint64_t server_addr;
+	uint32_t server_rkey;
+	uint32_t features; // FEAT_* agreed in the handshake
+	int max_rd;        // reads it lets us keep outstanding
+	uint64_t nr_owned; // remote pages (or splits of them) placed on this server
+	// Its region holds only those, packed in page order: remote page p is
+	// (split) shard_index[p] there, which is remote page shard_page[] of it
+	uint32_t shard_index[REMOTE_PAGENUM]; // PAGE_NONE if not held here
+	uint32_t shard_page[REMOTE_PAGENUM];
+	uint64_t reads;
+	int reads_inflight;
+	int failed;      // connection lost; reconnected with backoff
+	int attempts;    // reconnect attempts since it failed
+	uint64_t retry_at; // earliest time of the next attempt (ns)
+	struct regmem parity_rm;
+	struct regmem batch_rm;
+	struct regmem hedge_rm; // its own hedge slot
+	// Local bytes a read given up on by an earlier fault (a hedge loser or
+	// a coding straggler) may still land in; empty once none is in flight
+	char *stray;
+	size_t stray_len;
+	uint32_t max_msg; // largest message the port takes
+	uint32_t max_inline; // largest send the demand QP carries inline
+	struct rdma_cm_id *bulk; // low-priority connection, if the server has one
+	struct ibv_comp_channel *comp_chan; // with -w
+	int cq_armed;
+	uint64_t idle_since; // last post or completion on the CQ, 0: busy
+	// One-sided WRs are queued in post_wr, whose sge and list links are
+	// set up once, and posted together by post_flush(): with the ibv_wr_*
+	// API where the QP supports it, else with ibv_post_send.
+	struct ibv_qp_ex *qpx, *bulk_qpx; // NULL: classic posting
+	struct ibv_send_wr post_wr[POST_MAX];
+	struct ibv_sge post_sge[POST_MAX];
+	int nr_post;
+#ifdef PROFILE_POST
+	uint64_t post_start;
+#endif
+	uint64_t bulk_bytes;     // writeback bytes in flight to it
+	// Writeback WRs in post order. Only some are signaled; a completion
+	// retires every WR up to it (the id carries its sequence number).
+	uint8_t wb_fifo[WB_SLOTS]; // slot of each WR in flight
+	uint32_t wb_posted;
+	uint32_t wb_retired;
+	int unsignaled; // notifications since the last signaled one
+	struct regmem wb_rm;
+
+	// Server chunk-to-rkey table, filled in by CTRL_MR_TABLE messages
+	struct mr_chunk_entry *chunks;
+	uint32_t nr_chunks;
+	uint64_t chunk_size;
+	char *chunk_valid;
+
+	// Tiered servers: DRAM slot of each remote page, PAGE_NONE while demoted
+	int region_known;
+	uint32_t region_flags; // REGION_* of the last CTRL_REGION_INFO
+	uint32_t *page_slot;
+	uint32_t nr_remote_pages;
+	uint32_t promote_failed; // last page the server could not promote
+
+	// Push-prefetch landing ring (-p). Slots for pushes [landing_tail,
+	// landing_head) hold the pages in landing_page[]; the rest are free.
+	char *landing;
+	struct huge_mem landing_mem;
+	struct regmem landing_rm;
+	uint32_t landing_page[LANDING_MAX_SLOTS];
+	uint64_t landing_head;
+	uint64_t landing_tail;
+	uint64_t landing_hits;
+};
+
+#define MAX_SERVERS 16
+#define DEFAULT_SERVER "10.10.10.221:5000"
+#define DEFAULT_PORT 5000
+#define CM_TIMEOUT_MS 5000          // longest wait for one connection setup step
+#define RECONNECT_MIN_NS 10000000ULL // first retry after 10ms, doubling
+#define RECONNECT_MAX_NS 2000000000ULL
+#define RECONNECT_STANDBY_AFTER 4   // failed attempts before trying the standby
+#define CM_CHECK_NS 1000000ULL      // idle check for CM events every 1ms
+#define MAX_RD 16                   // outstanding reads asked of each server
+#define BULK_RECV_SLOTS 16          // receives for pushes on the bulk QP
+
 // Define global variables
-struct rdma_cm_id *conn = NULL;
-struct ibv_pd *pd;
-struct ibv_mr *mr;
-struct ibv_cq *cq;
+struct server servers[MAX_SERVERS];
+int nr_servers;
+struct chash ring; // remote page -> index into servers[]
 char *buffer;
+struct huge_mem buffer_mem;
+int nic_node = -1; // NUMA node of the RDMA device
 int fd;
 int ret;
-uint64_t server_addr;
-uint32_t server_rkey;
 int next_page = 0;
+int landing_slots; // per server
+int nr_stripes = 1; // servers each remote page is split over (-k)
+size_t stripe_size = BUFFER_SIZE;
+int splits_per_page = 1; // splits a server packs into each of its pages
+int nr_parity; // erasure-coded parity splits per page on further servers (-m)
+struct ec code;
+char *parity_buf; // parity splits of the page being read or written
+struct huge_mem parity_mem;
 
-struct mr_info
+// Runs of queued faults on consecutive remote pages are read with one
+// READ into consecutive batch slots, and each fault is then served from
+// its slot. Pages [batch_first, batch_first + batch_count) are there.
+// Off unless -M: the driver only installs from the staging buffer, so
+// every merged page costs a 2MB copy that may well outweigh the READs
+// saved; queue_tester -E runs with and without it tell.
+#define COALESCE_MAX 8
+int coalesce;
+char *batch;
+struct huge_mem batch_mem;
+uint32_t batch_first;
+uint32_t batch_count;
+uint64_t coalesced_reads; // merged READs
+uint64_t coalesced_pages; // pages they brought in
+uint64_t batch_copy_ns;   // spent copying pages out of batch slots
+
+// Traffic classes. Demand reads and everything a fault waits for use the
+// demand connection to each server; writeback, and the server's pushes,
+// use a second connection so that bulk transfers never queue ahead of a
+// demand READ on one QP. At most bulk_max bytes of writeback are in flight
+// per server, which bounds what a demand READ shares the link with. -T
+// sets the IP type of service (the service level on RoCE) of each class.
+#define BULK_MAX_DEFAULT (4 * 1024 * 1024)
+size_t bulk_max = BULK_MAX_DEFAULT; // -B
+int tos_demand = -1, tos_bulk = -1; // -T, -1 leaves the default
+
+// Hybrid completion waiting (-w): a wait on one server (control replies,
+// reads, promotions, fences) that has seen no post or completion on it for
+// spin_ns arms the CQ and sleeps on its completion channel. Waits on
+// several servers (striped and hedged reads) and the fault loop spin.
+long spin_ns = -1; // -1: busy-poll only
+uint64_t cq_sleeps;
+
+// A page being written back, from a copy in its slot. Bit j of the masks
+// stands for split j of the page (or replica j).
+struct wb_slot
 {
-	uintptr_t remote_addr;
-	uint32_t rkey;
-	size_t mem_size; // used for client request allocation
-};
+	uint32_t page;
+	uint32_t all;    // every split; 0 while the slot is free
+	uint32_t posted; // splits sent, including those done
+	uint32_t done;   // splits written
+	uint64_t seq;    // the newest copy of a page wins
+} wb[WB_SLOTS];
+int wb_busy;
+uint64_t wb_seq;
+uint64_t writebacks;
+char *wb_buf; // WB_SLOTS slots: page data, then its parity splits
+size_t wb_slot_size;
+struct huge_mem wb_mem;
+struct rdma_event_channel *ec;
+struct sockaddr_in standby_addr; // -S: takes over for a server that stays down
+char standby_name[64];
+int standby_free;
 
-// Define global mutex and atomic flag
-pthread_mutex_t send_receive_mutex = PTHREAD_MUTEX_INITIALIZER;
-atomic_bool send_receive_in_progress = false;
-#ifdef EXIT
-volatile sig_atomic_t exit_requested = false;
-#endif
+// Fetch granularity (-g). Remote pages stay 2MB for placement, tiering and
+// pushes, but a fault only fetches the fetch_size aligned piece around the
+// faulting address into the same offset of the staging buffer. With -g
+// auto every remote page gets its own unit, chosen from how many distinct
+// 4KB sub-pages it needed over the last DENSITY_WINDOW faults: sparse
+// pages fetch 4KB, dense ones the whole page. The UVM driver installs the
+// whole staging buffer after every fault, rest of it stale, so units below
+// 2MB are only taken with the stand-in queue (-q).
+size_t fetch_size = BUFFER_SIZE;
+int fetch_auto;
+struct density
+{
+	uint64_t touched[SUBPAGES / 64]; // sub-pages fetched this window
+	uint32_t nr_touched;
+	uint64_t window_start; // nr_faults when the window opened
+	size_t fetch_size;     // unit chosen from the last window
+} density[REMOTE_PAGENUM];
+uint64_t nr_faults;
+uint64_t fetched_bytes;
+
+// Hedged reads (-r). A demand read still outstanding after the running
+// HEDGE_PERCENTILE of recent read latencies is issued again to the next
+// replica, and the first copy to land completes the fault. Hedges draw on
+// a token bucket refilled by hedge_budget tokens per read, so extra
+// traffic stays below that fraction of demand reads.
+#define HEDGE_SAMPLES 256
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_NS 20000 // threshold until enough samples are in
+#define HEDGE_BURST 8.0    // most tokens the bucket holds
+int nr_replicas = 1;
+double hedge_budget = 0.05;
+double hedge_tokens = HEDGE_BURST;
+uint64_t hedge_lat[HEDGE_SAMPLES];
+uint64_t hedge_nr_lat;
+uint64_t hedge_threshold = HEDGE_MIN_NS;
+uint64_t hedges;
+uint64_t hedge_wins;
+// Hedges land in a slot of their server's own rather than in the staging
+// buffer, and a winning one is copied over; a losing one bothers nobody
+char *hedge_buf; // one BUFFER_SIZE slot per server
+struct huge_mem hedge_mem;
+
+// Signals never interrupt the fault loop: they are blocked in every
+// thread and read from a signalfd by the event thread, which hands them to
+// the fault loop through this ring. Only the event thread moves head and
+// only the fault loop moves tail, so the handoff needs no lock.
+#define EVENT_RING_SIZE 16
+enum loop_event_type
+{
+	EV_SIGINT = 1, // write page 0 back (and exit with EXIT)
+	EV_SIGIO,      // the UVM driver wants FAULT_HANDLED
+};
+struct event_ring
+{
+	int type[EVENT_RING_SIZE];
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+} events;
+int sig_fd = -1;
+pthread_t event_tid;
 
 #ifdef PROFILE
 FILE *log_file = NULL; // Global file descriptor
@@ -77,417 +313,2725 @@ FILE *log_file = NULL; // Global file descriptor
 FILE *log_file = NULL; // Global file descriptor
 #endif
 
+void server_failed(struct server *s, const char *why);
+
 // Function to post a receive work request
-void
-post_receive()
+int
+post_receive(struct server *s, int slot)
 {
-	// Post a receive WR to the server's receive queue
-	printf("Posting a receive WR...\n");
 	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
 	struct ibv_sge recv_sge;
 	memset(&recv_wr, 0, sizeof(recv_wr));
-	recv_wr.wr_id = 1;
-	recv_sge.addr = (uintptr_t)buffer;
-	recv_sge.length = BUFFER_SIZE;
-	recv_sge.lkey = mr->lkey;
+	recv_wr.wr_id = WR_RECV | slot;
+	recv_sge.addr = (uintptr_t)s->ctrl_buf + slot * CTRL_MSG_SIZE;
+	recv_sge.length = CTRL_MSG_SIZE;
+	recv_sge.lkey = s->ctrl_mr->lkey;
 	recv_wr.sg_list = &recv_sge;
 	recv_wr.num_sge = 1;
-	if (ibv_post_recv(conn->qp, &recv_wr, &bad_recv_wr))
+	if (ibv_post_recv(s->conn->qp, &recv_wr, &bad_recv_wr))
+	{
+		perror("ibv_post_recv");
+		server_failed(s, "cannot post receive");
+		return -1;
+	}
+	return 0;
+}
+
+// Receive for a push notification (no payload) on the bulk QP
+int
+post_bulk_receive(struct server *s)
+{
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
+
+	memset(&recv_wr, 0, sizeof(recv_wr));
+	recv_wr.wr_id = WR_BULK_RECV;
+	recv_wr.num_sge = 0;
+	if (ibv_post_recv(s->bulk->qp, &recv_wr, &bad_recv_wr))
+	{
+		perror("ibv_post_recv");
+		server_failed(s, "cannot post receive");
+		return -1;
+	}
+	return 0;
+}
+
+// Merge table entries [first, first + count) into the local copy
+void
+update_chunk_table(struct server *s, struct mr_table_msg *msg)
+{
+	uint32_t i;
+
+	if (msg->nr_chunks > s->nr_chunks)
+	{
+		s->chunks = realloc(s->chunks, msg->nr_chunks * sizeof(*s->chunks));
+		s->chunk_valid = realloc(s->chunk_valid, msg->nr_chunks);
+		if (!s->chunks || !s->chunk_valid)
+		{
+			perror("realloc");
+			exit(1);
+		}
+		memset(s->chunk_valid + s->nr_chunks, 0, msg->nr_chunks - s->nr_chunks);
+		s->nr_chunks = msg->nr_chunks;
+	}
+	s->chunk_size = msg->chunk_size;
+
+	for (i = 0; i < msg->count && msg->first + i < s->nr_chunks; i++)
+	{
+		s->chunks[msg->first + i] = msg->entries[i];
+		s->chunk_valid[msg->first + i] = 1;
+	}
+}
+
+void
+region_info(struct server *s, struct region_info_msg *msg)
+{
+	uint32_t i;
+
+	if (msg->flags & REGION_TIERED)
+	{
+		free(s->page_slot);
+		s->nr_remote_pages = msg->nr_pages;
+		s->page_slot = malloc(s->nr_remote_pages * sizeof(*s->page_slot));
+		if (!s->page_slot)
+		{
+			perror("malloc");
+			exit(1);
+		}
+		for (i = 0; i < s->nr_remote_pages; i++)
+			s->page_slot[i] = i < msg->nr_slots && !(msg->flags & REGION_SLOTS_MOVED) ? i : PAGE_NONE;
+		printf("%s: region is tiered: %u DRAM slots for %u pages\n", s->name, msg->nr_slots, s->nr_remote_pages);
+	}
+	s->region_known = 1;
+	s->region_flags = msg->flags;
+
+	if (msg->flags & REGION_WARM)
+		printf("%s: region is warm: %lu of %lu pages kept\n", s->name, msg->nr_valid, msg->nr_pages);
+	else if (msg->flags & REGION_PERSISTENT)
+		printf("%s: region is persistent and empty\n", s->name);
+}
+
+void
+page_promoted(struct server *s, struct promoted_msg *msg)
+{
+	if (!s->page_slot)
+		return;
+	if (msg->victim < s->nr_remote_pages)
+		s->page_slot[msg->victim] = PAGE_NONE;
+	if (msg->slot == PAGE_NONE)
+		s->promote_failed = msg->page;
+	else if (msg->page < s->nr_remote_pages)
+		s->page_slot[msg->page] = msg->slot;
+}
+
+// A writeback of page is still on its way to the servers
+bool
+wb_pending(uint32_t page)
+{
+	int i;
+
+	for (i = 0; i < WB_SLOTS; i++)
+	{
+		if (wb[i].all && wb[i].page == page)
+			return true;
+	}
+	return false;
+}
+
+void
+handle_imm(struct server *s, uint32_t imm)
+{
+	uint32_t page;
+
+	switch (IMM_OP(imm))
+	{
+	case IMM_OP_PUSH:
+		if (landing_slots && s->landing_head - s->landing_tail < landing_slots)
+		{
+			// a push racing a writeback of its page may carry the old
+			// contents; the slot is still used up, only never served
+			page = IMM_PAGE(imm) < s->nr_owned ? s->shard_page[IMM_PAGE(imm)] : PAGE_NONE;
+			s->landing_page[s->landing_head % landing_slots] =
+			    page == PAGE_NONE || wb_pending(page) ? PAGE_NONE : page;
+			s->landing_head++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void
+handle_recv(struct server *s, struct ibv_wc *wc)
+{
+	int slot = WR_SLOT(wc->wr_id);
+	struct ctrl_hdr *hdr = (struct ctrl_hdr *)(s->ctrl_buf + slot * CTRL_MSG_SIZE);
+
+	if (wc->opcode == IBV_WC_RECV && wc->byte_len >= sizeof(*hdr))
+	{
+		switch (hdr->type)
+		{
+		case CTRL_MR_TABLE:
+			update_chunk_table(s, (struct mr_table_msg *)hdr);
+			break;
+		case CTRL_REGION_INFO:
+			region_info(s, (struct region_info_msg *)hdr);
+			break;
+		case CTRL_PROMOTED:
+			page_promoted(s, (struct promoted_msg *)hdr);
+			break;
+		default:
+			fprintf(stderr, "%s: unknown control message %u\n", s->name, hdr->type);
+			break;
+		}
+	}
+	else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+	{
+		handle_imm(s, ntohl(wc->imm_data));
+	}
+	post_receive(s, slot);
+}
+
+uint64_t
+now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Take a server whose connection broke out of service. With erasure
+// coding or replicas reads go on from the other servers; otherwise the
+// fault that needs it reconnects first (recover_servers).
+void
+server_failed(struct server *s, const char *why)
+{
+	int i, live = 0;
+
+	if (s->failed)
+		return;
+	s->failed = 1;
+	s->attempts = 0;
+	s->retry_at = now_ns();
+	for (i = 0; i < nr_servers; i++)
+		live += !servers[i].failed;
+	fprintf(stderr, "%s: %s; %d of %d servers left\n", s->name, why, live, nr_servers);
+}
+
+void wb_done(struct server *s, int slot);
+
+void
+handle_wc(struct server *s, struct ibv_wc *wc)
+{
+	// nothing is left to land once every read has completed
+	if (wc->wr_id == WR_READ && !--s->reads_inflight)
+		s->stray_len = 0;
+	if (wc->status != IBV_WC_SUCCESS)
+	{
+		fprintf(stderr, "%s: failed status %s (%d) for wr_id %d\n", s->name,
+		        ibv_wc_status_str(wc->status), wc->status, (int)wc->wr_id);
+		server_failed(s, "work request failed");
+		return;
+	}
+	switch (WR_KIND(wc->wr_id))
+	{
+	case WR_RECV:
+		handle_recv(s, wc);
+		break;
+	case WR_BULK_RECV:
+		if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+			handle_imm(s, ntohl(wc->imm_data));
+		post_bulk_receive(s);
+		break;
+	case WR_WB:
+		// every writeback up to this one has landed
+		do
+			wb_done(s, s->wb_fifo[s->wb_retired++ % WB_SLOTS]);
+		while (((s->wb_retired - 1) & 0xff) != WR_SLOT(wc->wr_id));
+		break;
+	}
+}
+
+// The CQ of s has been quiet for spin_ns. The first call arms it and
+// returns, so that the caller polls once more and catches a completion
+// that raced the arming; the next one sleeps until the CQ has an event.
+void
+cq_idle_wait(struct server *s)
+{
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+
+	if (!s->cq_armed)
+	{
+		if (ibv_req_notify_cq(s->cq, 0))
+			server_failed(s, "cannot arm CQ");
+		s->cq_armed = 1;
+		return;
+	}
+	if (ibv_get_cq_event(s->comp_chan, &ev_cq, &ev_ctx))
+	{
+		server_failed(s, "completion channel failed");
+		return;
+	}
+	ibv_ack_cq_events(ev_cq, 1);
+	s->cq_armed = 0;
+	cq_sleeps++;
+}
+
+// Poll until wr_id completes on s, handling incoming control messages
+// meanwhile. wr_id 0 polls once and returns, for callers looping until
+// something on s changes. -1 if s failed. With -w a wait spins for
+// spin_ns after the last post or completion on s, across such calls,
+// then sleeps; callers waiting on several servers at once use drain_cq().
+int
+wait_wr(struct server *s, uint64_t wr_id)
+{
+	struct ibv_wc wc;
+
+	do
+	{
+		if (s->failed)
+			return -1;
+		if (ibv_poll_cq(s->cq, 1, &wc) < 1)
+		{
+			if (s->comp_chan && !s->idle_since)
+				s->idle_since = now_ns();
+			else if (s->comp_chan && now_ns() - s->idle_since >= (uint64_t)spin_ns)
+				cq_idle_wait(s);
+			if (!wr_id)
+				return 0;
+			continue;
+		}
+		s->idle_since = 0;
+		handle_wc(s, &wc);
+		if (wc.status == IBV_WC_SUCCESS && WR_KIND(wc.wr_id) != WR_RECV && wc.wr_id == wr_id)
+			return 0;
+	} while (1);
+}
+
+// Handle everything that has completed on s so far without blocking
+void
+drain_cq(struct server *s)
+{
+	struct ibv_wc wc;
+
+	while (!s->failed && ibv_poll_cq(s->cq, 1, &wc) > 0)
+		handle_wc(s, &wc);
+}
+
+// Servers holding the splits of remote page: split j is on stripe[j], the
+// owner and the next distinct servers along the ring. Splits [0, nr_stripes)
+// are the data stripes, followed by nr_parity parity splits. With replicas
+// every "split" is a full copy of the page.
+int
+page_stripes(uint32_t page, struct server **stripe)
+{
+	int idx[MAX_SERVERS], j;
+	int n = nr_replicas > 1 ? nr_replicas : nr_stripes + nr_parity;
+
+	chash_lookup_n(&ring, page, idx, n);
+	for (j = 0; j < n; j++)
+		stripe[j] = &servers[idx[j]];
+	return n;
+}
+
+// Offset in the page of the data split j holds: stripe j sits at
+// j * stripe_size, and parity split k + i lines up with stripe i
+uint64_t
+split_offset(int j)
+{
+	if (nr_replicas > 1)
+		return 0;
+	return (uint64_t)(j % nr_stripes) * stripe_size;
+}
+
+// Local memory of split j: the staging buffer for data, else parity_buf.
+// Every replica is the whole staging buffer.
+char *
+split_local(int j)
+{
+	if (nr_replicas > 1)
+		return buffer;
+	if (j < nr_stripes)
+		return buffer + j * stripe_size;
+	return parity_buf + (j - nr_stripes) * stripe_size;
+}
+
+// Where hedged reads from s land
+char *
+hedge_slot(struct server *s)
+{
+	return hedge_buf + (s - servers) * BUFFER_SIZE;
+}
+
+// Length of stripe j; the last one takes what is left of the page
+size_t
+stripe_len(int j)
+{
+	return j == nr_stripes - 1 ? BUFFER_SIZE - j * stripe_size : stripe_size;
+}
+
+// Server s holds (a stripe of) remote page
+bool
+page_on_server(uint32_t page, struct server *s)
+{
+	struct server *stripe[MAX_SERVERS];
+	int j, n;
+
+	n = page_stripes(page, stripe);
+	for (j = 0; j < n; j++)
+	{
+		if (stripe[j] == s)
+			return true;
+	}
+	return false;
+}
+
+// Page of the region of s that holds remote page, or its split of it
+uint32_t
+server_page(struct server *s, uint32_t remote)
+{
+	return s->shard_index[remote] / splits_per_page;
+}
+
+// Zero-length RDMA write with immediate data: a one-way note to the server
+void
+notify_server(struct server *s, uint32_t op, uint32_t page)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+
+	if (s->failed || !(s->features & FEAT_NOTIFY))
+		return;
+	memset(&send_wr, 0, sizeof(send_wr));
+	send_wr.wr_id = WR_NOTIFY;
+	send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	// Nobody waits for a notification; the occasional signaled one lets
+	// the send queue slots of those before it be reused
+	if (++s->unsignaled == SIGNAL_EVERY)
+	{
+		send_wr.send_flags = IBV_SEND_SIGNALED;
+		s->unsignaled = 0;
+	}
+	send_wr.wr.rdma.remote_addr = s->server_addr;
+	send_wr.wr.rdma.rkey = s->server_rkey;
+	send_wr.imm_data = htonl(IMM_ENCODE(op, page));
+	send_wr.num_sge = 0;
+	if (ibv_post_send(s->conn->qp, &send_wr, &bad_send_wr))
+		server_failed(s, "cannot post");
+}
+
+// Free landing slots up to and including push seq, returning the credits
+void
+landing_free(struct server *s, uint64_t seq)
+{
+	uint32_t count = seq + 1 - s->landing_tail;
+
+	s->landing_tail = seq + 1;
+	notify_server(s, IMM_OP_CREDIT, count);
+}
+
+// Forget pushed copies of page, once it is written: they are stale. Their
+// slots are freed in order along with the others.
+void
+landing_drop(struct server *s, uint32_t page)
+{
+	uint64_t seq;
+
+	if (!(s->features & FEAT_LANDING))
+		return;
+	for (seq = s->landing_tail; seq < s->landing_head; seq++)
+	{
+		if (s->landing_page[seq % landing_slots] == page)
+			s->landing_page[seq % landing_slots] = PAGE_NONE;
+	}
+}
+
+void fence_stray(struct server *s, char *local, size_t len);
+
+// Serve page from the landing ring if the server already pushed it. Older
+// pushes are freed along with it: the access stream has moved past them.
+// On a miss with the ring full, the oldest half is dropped so the server
+// can keep pushing.
+bool
+landing_lookup(struct server *s, uint32_t page)
+{
+	uint64_t seq;
+
+	if (!(s->features & FEAT_LANDING) || s->failed)
+		return false;
+	drain_cq(s);
+	for (seq = s->landing_tail; seq < s->landing_head; seq++)
+	{
+		if (s->landing_page[seq % landing_slots] == page)
+		{
+			fence_stray(NULL, buffer, BUFFER_SIZE);
+			memcpy(buffer, s->landing + (seq % landing_slots) * BUFFER_SIZE, BUFFER_SIZE);
+			landing_free(s, seq);
+			s->landing_hits++;
+			return true;
+		}
+	}
+	if (s->landing_head - s->landing_tail == landing_slots)
+		landing_free(s, s->landing_tail + (landing_slots + 1) / 2 - 1);
+	return false;
+}
+
+// Send a control message to the server and wait for it to go out. A
+// message that fits max_inline is copied into the WR at post time instead
+// of being read from the registered send slot.
+void
+send_ctrl(struct server *s, const void *msg, size_t len)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge send_sge;
+	char *slot_buf = s->ctrl_buf + CTRL_RECV_SLOTS * CTRL_MSG_SIZE;
+
+	if (s->failed || !(s->features & FEAT_CTRL))
+		return;
+	memset(&send_wr, 0, sizeof(send_wr));
+	send_wr.wr_id = WR_CTRL_SEND;
+	send_wr.opcode = IBV_WR_SEND;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	if (len <= s->max_inline)
+	{
+		send_wr.send_flags |= IBV_SEND_INLINE;
+		send_sge.addr = (uintptr_t)msg;
+	}
+	else
+	{
+		memcpy(slot_buf, msg, len);
+		send_sge.addr = (uintptr_t)slot_buf;
+	}
+	send_sge.length = len;
+	send_sge.lkey = s->ctrl_mr->lkey;
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	if (ibv_post_send(s->conn->qp, &send_wr, &bad_send_wr))
+	{
+		server_failed(s, "cannot post");
+		return;
+	}
+	s->idle_since = 0;
+	wait_wr(s, WR_CTRL_SEND);
+}
+
+// Tell server s which of its remote pages are about to be used; an ODP
+// server faults them in ahead of our reads and a tiered one keeps them in
+// DRAM. It only hears about the runs of pages it holds stripes of.
+void
+advise_hot_server(struct server *s, uint32_t first, uint32_t count)
+{
+	struct hot_pages_msg msg;
+	uint32_t page, run;
+
+	msg.hdr.type = CTRL_HOT_PAGES;
+	msg.hdr.len = sizeof(msg);
+	for (page = first; page < first + count; page += run)
+	{
+		if (!page_on_server(page, s))
+		{
+			run = 1;
+			continue;
+		}
+		for (run = 1; page + run < first + count && page_on_server(page + run, s); run++)
+			;
+		msg.first = server_page(s, page);
+		msg.count = server_page(s, page + run - 1) - msg.first + 1;
+		send_ctrl(s, &msg, sizeof(msg));
+	}
+}
+
+void
+advise_hot(uint32_t first, uint32_t count)
+{
+	int i;
+
+	for (i = 0; i < nr_servers; i++)
+		advise_hot_server(&servers[i], first, count);
+}
+
+// Server address of remote page (of its split, if striped) on s. A page a
+// tiered server has demoted is promoted first with a two-sided request;
+// this must only be called with no reads outstanding, since the promotion
+// may reuse a slot.
+uint64_t
+remote_page_addr(struct server *s, uint32_t remote)
+{
+	struct promote_msg msg;
+	uint32_t page = server_page(s, remote);
+	uint64_t off = (uint64_t)(s->shard_index[remote] % splits_per_page) * stripe_size;
+
+	while (!s->region_known && !s->failed)
+		wait_wr(s, 0);
+	if (!s->page_slot || s->failed)
+		return s->server_addr + (uint64_t)page * BUFFER_SIZE + off;
+	if (page >= s->nr_remote_pages)
+	{
+		fprintf(stderr, "Remote page %u outside %s region\n", remote, s->name);
+		server_failed(s, "page outside its region");
+		return s->server_addr + (uint64_t)page * BUFFER_SIZE + off;
+	}
+
+	if (s->page_slot[page] == PAGE_NONE)
+	{
+		// nor may it pull a slot from under a writeback
+		while (s->bulk_bytes && !s->failed)
+			wait_wr(s, 0);
+		msg.hdr.type = CTRL_PROMOTE;
+		msg.hdr.len = sizeof(msg);
+		msg.page = page;
+		send_ctrl(s, &msg, sizeof(msg));
+		// the reply may also be a failure, which leaves the slot unset
+		while (s->page_slot[page] == PAGE_NONE && !s->failed)
+		{
+			wait_wr(s, 0);
+			if (s->promote_failed == page)
+			{
+				fprintf(stderr, "%s failed to promote page %u\n", s->name, remote);
+				server_failed(s, "promotion failed");
+			}
+		}
+		if (s->failed)
+			return s->server_addr + (uint64_t)page * BUFFER_SIZE + off;
+	}
+	return s->server_addr + (uint64_t)s->page_slot[page] * BUFFER_SIZE + off;
+}
+
+// rkey of the chunk of s holding addr; waits for its table entry if the
+// server is still registering that chunk
+uint32_t
+remote_rkey(struct server *s, uint64_t addr)
+{
+	uint64_t idx;
+
+	while (!s->chunk_size && !s->failed)
+		wait_wr(s, 0);
+	if (s->failed)
+		return 0;
+	idx = (addr - s->server_addr) / s->chunk_size;
+	if (addr < s->server_addr || idx >= s->nr_chunks)
+	{
+		fprintf(stderr, "Remote address %lx outside %s region\n", addr, s->name);
+		server_failed(s, "address outside its region");
+		return 0;
+	}
+	while (!s->chunk_valid[idx] && !s->failed)
+		wait_wr(s, 0);
+	return s->chunks[idx].rkey;
+}
+
+#ifdef PROFILE_POST
+uint64_t post_ns, post_wrs, post_doorbells;
+#endif
+
+// Create the QP of id, asking for the ibv_wr_* ops used by post_flush();
+// *qpx is NULL if the device only takes ibv_post_send. A device that
+// refuses inline data gets a QP without it rather than none.
+int
+create_qp(struct server *s, struct rdma_cm_id *id, struct ibv_qp_init_attr *qp_attr,
+          struct ibv_qp_ex **qpx)
+{
+#ifndef CLASSIC_POST
+	struct ibv_qp_init_attr_ex attr_ex;
+
+	memset(&attr_ex, 0, sizeof(attr_ex));
+	attr_ex.qp_type = qp_attr->qp_type;
+	attr_ex.send_cq = qp_attr->send_cq;
+	attr_ex.recv_cq = qp_attr->recv_cq;
+	attr_ex.cap = qp_attr->cap;
+	attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+	attr_ex.pd = s->pd;
+	attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_READ | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+	                         IBV_QP_EX_WITH_SEND;
+	if (!rdma_create_qp_ex(id, &attr_ex))
+	{
+		qp_attr->cap = attr_ex.cap;
+		*qpx = ibv_qp_to_qp_ex(id->qp);
+		return 0;
+	}
+#endif
+	*qpx = NULL;
+	if (!rdma_create_qp(id, s->pd, qp_attr))
+		return 0;
+	if (!qp_attr->cap.max_inline_data)
+		return -1;
+	qp_attr->cap.max_inline_data = 0;
+	return rdma_create_qp(id, s->pd, qp_attr);
+}
+
+// Fill the fields of post_wr that never change
+void
+init_post(struct server *s)
+{
+	int i;
+
+	memset(s->post_wr, 0, sizeof(s->post_wr));
+	for (i = 0; i < POST_MAX; i++)
+	{
+		s->post_wr[i].sg_list = &s->post_sge[i];
+		s->post_wr[i].num_sge = 1;
+		s->post_wr[i].next = i + 1 < POST_MAX ? &s->post_wr[i + 1] : NULL;
+	}
+	s->nr_post = 0;
+}
+
+// Queue a one-sided op moving len bytes between local and addr on s. It
+// goes out with the next post_flush(); all WRs queued together must be of
+// one traffic class, at most POST_MAX of them.
+int
+post_add(struct server *s, uint64_t wr_id, enum ibv_wr_opcode opcode, uint64_t addr,
+         char *local, size_t len, uint32_t imm, int send_flags)
+{
+	struct ibv_send_wr *wr = &s->post_wr[s->nr_post];
+	struct ibv_sge *sge = wr->sg_list;
+
+#ifdef PROFILE_POST
+	if (!s->nr_post)
+		s->post_start = now_ns();
+#endif
+	wr->wr_id = wr_id;
+	wr->opcode = opcode;
+	wr->send_flags = send_flags;
+	wr->wr.rdma.remote_addr = addr;
+	wr->wr.rdma.rkey = remote_rkey(s, addr);
+	wr->imm_data = htonl(imm);
+	sge->addr = (uintptr_t)local;
+	sge->length = len;
+	if (local >= buffer && local < buffer + BUFFER_SIZE)
+		sge->lkey = regmem_lookup(&s->staging, local)->lkey;
+	else if (local >= batch && local < batch + COALESCE_MAX * BUFFER_SIZE)
+		sge->lkey = regmem_lookup(&s->batch_rm, local)->lkey;
+	else if (local >= wb_buf && local < wb_buf + WB_SLOTS * wb_slot_size)
+		sge->lkey = regmem_lookup(&s->wb_rm, local)->lkey;
+	else if (local >= hedge_buf && local < hedge_buf + nr_servers * BUFFER_SIZE)
+		sge->lkey = regmem_lookup(&s->hedge_rm, local)->lkey;
+	else
+		sge->lkey = regmem_lookup(&s->parity_rm, local)->lkey;
+	// the rkey lookup may have waited for a connection that broke
+	if (s->failed)
+	{
+		s->nr_post = 0;
+		return -1;
+	}
+	s->nr_post++;
+	return 0;
+}
+
+// Post the queued WRs, ringing the doorbell once
+int
+post_flush(struct server *s)
+{
+	struct ibv_send_wr *bad_send_wr = NULL;
+	int n = s->nr_post, bulk, ret, i;
+	struct ibv_qp_ex *qpx;
+
+	if (!n)
+		return 0;
+	s->nr_post = 0;
+	s->idle_since = 0;
+	bulk = WR_KIND(s->post_wr[0].wr_id) == WR_WB && s->bulk;
+	qpx = bulk ? s->bulk_qpx : s->qpx;
+	if (qpx)
+	{
+		ibv_wr_start(qpx);
+		for (i = 0; i < n; i++)
+		{
+			struct ibv_send_wr *wr = &s->post_wr[i];
+
+			qpx->wr_id = wr->wr_id;
+			qpx->wr_flags = wr->send_flags;
+			if (wr->opcode == IBV_WR_RDMA_READ)
+				ibv_wr_rdma_read(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+			else
+				ibv_wr_rdma_write_imm(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr, wr->imm_data);
+			ibv_wr_set_sge(qpx, wr->sg_list->lkey, wr->sg_list->addr, wr->sg_list->length);
+		}
+		ret = ibv_wr_complete(qpx);
+	}
+	else
+	{
+		s->post_wr[n - 1].next = NULL;
+		ret = ibv_post_send(bulk ? s->bulk->qp : s->conn->qp, s->post_wr, &bad_send_wr);
+		s->post_wr[n - 1].next = n < POST_MAX ? &s->post_wr[n] : NULL;
+	}
+	if (ret)
+	{
+		fprintf(stderr, "%s: posting failed: %s\n", s->name, strerror(ret));
+		server_failed(s, "cannot post");
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		s->reads_inflight += s->post_wr[i].wr_id == WR_READ;
+#ifdef PROFILE_POST
+	post_ns += now_ns() - s->post_start;
+	post_wrs += n;
+	post_doorbells++;
+#endif
+	return 0;
+}
+
+// Post a one-sided op moving len bytes between local and addr on s
+int
+post_rdma(struct server *s, uint64_t wr_id, enum ibv_wr_opcode opcode, uint64_t addr,
+          char *local, size_t len, uint32_t imm, int send_flags)
+{
+	if (post_add(s, wr_id, opcode, addr, local, len, imm, send_flags))
+		return -1;
+	return post_flush(s);
+}
+
+// Reads of s given up on may still land in [local, local + len); remember
+// that until s has none in flight
+void
+mark_stray(struct server *s, char *local, size_t len)
+{
+	char *end = local + len;
+
+	if (s->failed || !s->reads_inflight)
+		return;
+	if (s->stray_len)
+	{
+		if (s->stray < local)
+			local = s->stray;
+		if (s->stray + s->stray_len > end)
+			end = s->stray + s->stray_len;
+	}
+	s->stray = local;
+	s->stray_len = end - local;
+}
+
+// Wait for reads given up on that may still land in [local, local + len),
+// before s (NULL: the caller itself) puts something there. Those of s need
+// no wait: its QP lands them before anything posted after them.
+void
+fence_stray(struct server *s, char *local, size_t len)
+{
+	int i;
+
+	for (i = 0; i < nr_servers; i++)
+	{
+		struct server *t = &servers[i];
+
+		if (t == s || !t->stray_len || t->stray >= local + len || local >= t->stray + t->stray_len)
+			continue;
+		while (t->reads_inflight > 0 && !t->failed)
+			wait_wr(t, 0);
+		t->stray_len = 0;
+	}
+}
+
+void recover_servers();
+
+// Read bytes [off, off + len) of page from the servers in stripe[]. A
+// striped page is complete when every stripe overlapping that range landed.
+// An erasure-coded page is always read whole and is complete as soon as any
+// nr_stripes splits have landed, so one slow or dead server does not hold
+// the fault up; missing stripes are then decoded from parity.
+// -1 if too few servers are left to read the page, or if decoding failed,
+// for the caller to read it again.
+int
+read_splits(uint32_t page, struct server **stripe, int n, size_t off, size_t len)
+{
+	uint64_t addr[MAX_SERVERS];
+	uint8_t *split[MAX_SERVERS];
+	size_t lo[MAX_SERVERS], hi[MAX_SERVERS];
+	int posted[MAX_SERVERS], present[MAX_SERVERS];
+	int j, got = 0, need = 0, pending;
+
+	// the part of the range in each split, relative to its start
+	for (j = 0; j < n; j++)
+	{
+		lo[j] = 0;
+		hi[j] = stripe_len(j);
+		if (j < nr_stripes)
+		{
+			if (off > split_offset(j))
+				lo[j] = off - split_offset(j);
+			if (off + len < split_offset(j) + hi[j])
+				hi[j] = off + len > split_offset(j) ? off + len - split_offset(j) : 0;
+			if (lo[j] < hi[j])
+				need++;
+		}
+	}
+	if (nr_parity)
+		need = nr_stripes;
+
+	// Resolve every split before posting: a promotion must not overlap a
+	// read from the same server
+	for (j = 0; j < n; j++)
+	{
+		if (!stripe[j]->failed && lo[j] < hi[j])
+			addr[j] = remote_page_addr(stripe[j], page);
+	}
+	for (j = 0; j < n; j++)
+	{
+		split[j] = (uint8_t *)split_local(j);
+		present[j] = 0;
+		if (!stripe[j]->failed && lo[j] < hi[j])
+			fence_stray(stripe[j], split_local(j) + lo[j], hi[j] - lo[j]);
+		posted[j] = !stripe[j]->failed && lo[j] < hi[j] &&
+		            !post_rdma(stripe[j], WR_READ, IBV_WR_RDMA_READ, addr[j] + lo[j],
+		                       split_local(j) + lo[j], hi[j] - lo[j], 0, IBV_SEND_SIGNALED);
+	}
+
+	// Wait for send completion. Every server holds one split of the page,
+	// so its read is done when it has none in flight.
+	while (got < need)
+	{
+		pending = 0;
+		for (j = 0; j < n; j++)
+		{
+			if (!posted[j] || present[j])
+				continue;
+			// sleeping on one server would hold up the others
+			if (n > 1)
+				drain_cq(stripe[j]);
+			else
+				wait_wr(stripe[j], 0);
+			if (stripe[j]->failed)
+				posted[j] = 0;
+			else if (!stripe[j]->reads_inflight)
+			{
+				present[j] = 1;
+				stripe[j]->reads++;
+				got++;
+			}
+			else
+				pending++;
+		}
+		if (got < need && !pending)
+		{
+			fprintf(stderr, "Remote page %u: %d of %d splits readable\n", page, got, need);
+			return -1;
+		}
+	}
+	// decoding rewrites the missing splits
+	for (j = 0; nr_parity && j < n; j++)
+	{
+		if (!present[j])
+			fence_stray(NULL, split_local(j), stripe_len(j));
+	}
+	// a coding straggler is left to land on its own
+	for (j = 0; j < n; j++)
+	{
+		if (posted[j] && !present[j])
+			mark_stray(stripe[j], split_local(j) + lo[j], hi[j] - lo[j]);
+	}
+	if (nr_parity && ec_decode(&code, split, present, stripe_size))
+	{
+		fprintf(stderr, "Remote page %u: decode failed\n", page);
+		return -1;
+	}
+	return 0;
+}
+
+int
+lat_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Add a read latency and refresh the hedge threshold now and then
+void
+hedge_sample(uint64_t ns)
+{
+	uint64_t sorted[HEDGE_SAMPLES], n;
+
+	hedge_lat[hedge_nr_lat++ % HEDGE_SAMPLES] = ns;
+	if (hedge_nr_lat < HEDGE_SAMPLES / 4 || hedge_nr_lat % 32)
+		return;
+	n = hedge_nr_lat < HEDGE_SAMPLES ? hedge_nr_lat : HEDGE_SAMPLES;
+	memcpy(sorted, hedge_lat, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), lat_cmp);
+	hedge_threshold = sorted[n * HEDGE_PERCENTILE / 100];
+}
+
+// Post a read of [off, off + len) of page from the next live replica at or
+// after *next, into the staging buffer if direct, else into the replica's
+// hedge slot. Returns the replica index, or -1 if none is left.
+int
+hedge_post(uint32_t page, struct server **replica, int n, int *next, size_t off, size_t len,
+           bool direct)
+{
+	uint64_t addr;
+	char *local;
+
+	for (; *next < n; (*next)++)
+	{
+		struct server *s = replica[*next];
+
+		if (s->failed)
+			continue;
+		addr = remote_page_addr(s, page);
+		local = (direct ? buffer : hedge_slot(s)) + off;
+		if (direct)
+			fence_stray(s, local, len);
+		if (!s->failed && !post_rdma(s, WR_READ, IBV_WR_RDMA_READ, addr + off, local, len, 0,
+		                             IBV_SEND_SIGNALED))
+			return (*next)++;
+	}
+	return -1;
+}
+
+// Read page from the first live replica, hedging to the next one when the
+// read runs past the threshold and the budget allows. One read at a time
+// targets the staging buffer directly; hedges land in their replica's slot
+// and are copied over only if they win. A loser left in the staging buffer
+// only holds up a later fault that puts other bytes there before it lands.
+// -1 if no replica is left.
+int
+read_hedged(uint32_t page, struct server **replica, int n, size_t off, size_t len)
+{
+	int active[MAX_SERVERS] = {0};
+	int j, next = 0, nr_active = 0, first, direct, winner = -1;
+	uint64_t start = now_ns();
+
+	hedge_tokens += hedge_budget;
+	if (hedge_tokens > HEDGE_BURST)
+		hedge_tokens = HEDGE_BURST;
+
+	first = direct = hedge_post(page, replica, n, &next, off, len, true);
+	if (first >= 0)
+	{
+		active[first] = 1;
+		nr_active++;
+	}
+	while (winner < 0)
+	{
+		if (!nr_active)
+		{
+			// every read so far failed: fall back to the next copy for free
+			j = hedge_post(page, replica, n, &next, off, len, true);
+			if (j < 0)
+			{
+				fprintf(stderr, "Remote page %u: no replica left\n", page);
+				return -1;
+			}
+			active[j] = 1;
+			nr_active++;
+			direct = j;
+		}
+		for (j = 0; j < n && winner < 0; j++)
+		{
+			if (!active[j])
+				continue;
+			// spins: the hedge must go out on time
+			drain_cq(replica[j]);
+			if (replica[j]->failed)
+			{
+				active[j] = 0;
+				nr_active--;
+			}
+			else if (!replica[j]->reads_inflight)
+				winner = j;
+		}
+		if (winner < 0 && next < n && hedge_tokens >= 1.0 && now_ns() - start > hedge_threshold)
+		{
+			j = hedge_post(page, replica, n, &next, off, len, false);
+			if (j >= 0)
+			{
+				active[j] = 1;
+				nr_active++;
+				hedge_tokens -= 1.0;
+				hedges++;
+			}
+		}
+	}
+	if (winner != direct)
+	{
+		// whatever was left to land there from before this fault first
+		fence_stray(NULL, buffer + off, len);
+		memcpy(buffer + off, hedge_slot(replica[winner]) + off, len);
+		if (active[direct])
+			mark_stray(replica[direct], buffer + off, len);
+	}
+	replica[winner]->reads++;
+	if (winner != first)
+		hedge_wins++;
+	hedge_sample(now_ns() - start);
+	return 0;
+}
+
+// Bytes to fetch for a fault at off in remote page: the -g size, or with
+// -g auto what the page's last window suggests. Density is the share of
+// the page fetched in the window: half or more is worth whole pages, a
+// sixteenth 64KB, less than that 4KB. A window of whole-page fetches says
+// nothing about density, so such a page is sampled again at 64KB.
+size_t
+fetch_unit(uint32_t page, size_t off)
+{
+	struct density *d = &density[page];
+	uint32_t sub;
+	size_t unit;
+
+	if (!fetch_auto)
+		return fetch_size;
+	if (nr_faults - d->window_start >= DENSITY_WINDOW)
+	{
+		if (d->fetch_size == BUFFER_SIZE)
+			unit = 64 * 1024;
+		else if (d->nr_touched * 2 >= SUBPAGES)
+			unit = BUFFER_SIZE;
+		else if (d->nr_touched * 16 >= SUBPAGES)
+			unit = 64 * 1024;
+		else
+			unit = SUBPAGE_SIZE;
+		d->fetch_size = unit;
+		memset(d->touched, 0, sizeof(d->touched));
+		d->nr_touched = 0;
+		d->window_start = nr_faults;
+	}
+	unit = d->fetch_size;
+	for (sub = (off & ~(unit - 1)) / SUBPAGE_SIZE; sub < ((off & ~(unit - 1)) + unit) / SUBPAGE_SIZE; sub++)
+	{
+		if (!(d->touched[sub / 64] & (1ULL << (sub % 64))))
+		{
+			d->touched[sub / 64] |= 1ULL << (sub % 64);
+			d->nr_touched++;
+		}
+	}
+	return unit;
+}
+
+bool wb_lookup(uint32_t page);
+
+// Serve page from the batch slots if a merged READ already brought it in
+bool
+batch_lookup(uint32_t page)
+{
+	uint64_t start;
+
+	if (page < batch_first || page >= batch_first + batch_count)
+		return false;
+	start = now_ns();
+	fence_stray(NULL, buffer, BUFFER_SIZE);
+	memcpy(buffer, batch + (size_t)(page - batch_first) * BUFFER_SIZE, BUFFER_SIZE);
+	batch_copy_ns += now_ns() - start;
+	return true;
+}
+
+// Read page and up to ahead following pages, which have faults queued
+// behind it, with one READ from their server s. The run ends where the
+// next page is not on s, is not fetched whole, does not follow in s's
+// memory or MR, or would exceed the port's message size. Then page is
+// served from its slot. False if there is no run of at least two pages
+// (or the READ failed), for read_page() to do a plain read.
+bool
+read_run(uint32_t page, int ahead, struct server *s)
+{
+	uint64_t addr, next;
+	uint32_t rkey;
+	int n;
+
+	if (!batch || s->failed || ahead < 1)
+		return false;
+	addr = remote_page_addr(s, page);
+	rkey = remote_rkey(s, addr);
+	for (n = 1; n <= ahead && n < COALESCE_MAX && page + n < REMOTE_PAGENUM; n++)
+	{
+		if ((n + 1) * (uint64_t)BUFFER_SIZE > s->max_msg || chash_lookup(&ring, page + n) != s - servers)
+			break;
+		if (fetch_auto && density[page + n].fetch_size != BUFFER_SIZE)
+			break;
+		// promoting it could demote a page of the run
+		if (s->page_slot && s->page_slot[server_page(s, page + n)] == PAGE_NONE)
+			break;
+		next = remote_page_addr(s, page + n);
+		if (s->failed || next != addr + (uint64_t)n * BUFFER_SIZE || remote_rkey(s, next) != rkey)
+			break;
+	}
+	if (n < 2 || s->failed)
+		return false;
+
+	batch_count = 0;
+	if (post_rdma(s, WR_READ, IBV_WR_RDMA_READ, addr, batch, (size_t)n * BUFFER_SIZE, 0, IBV_SEND_SIGNALED))
+		return false;
+	while (s->reads_inflight && !s->failed)
+		wait_wr(s, 0);
+	if (s->failed)
+		return false;
+	s->reads++;
+	coalesced_reads++;
+	coalesced_pages += n;
+	fetched_bytes += (uint64_t)n * BUFFER_SIZE;
+	batch_first = page;
+	batch_count = n;
+	return batch_lookup(page);
+}
+
+// Read the piece of remote page around offset off (within the page) into
+// the same offset of the staging buffer. ahead faults on the following
+// pages are queued behind this one.
+void
+read_page(uint32_t page, size_t off, int ahead)
+{
+	size_t len;
+
+	struct server *stripe[MAX_SERVERS];
+	int n;
+#ifdef PROFILE_READ
+	struct timespec start_time, end_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+#endif
+	n = page_stripes(page, stripe);
+	nr_faults++;
+	len = fetch_unit(page, off);
+	// parity covers whole splits
+	if (nr_parity)
+		len = BUFFER_SIZE;
+	off &= ~(len - 1);
+	if (wb_lookup(page))
+		return;
+	// Let the owner's predictor see every access to its pages, hit or miss
+	if (landing_slots)
+		notify_server(stripe[0], IMM_OP_ACCESS, server_page(stripe[0], page));
+	if (landing_lookup(stripe[0], page))
+		return;
+	if (len == BUFFER_SIZE && (batch_lookup(page) || read_run(page, ahead, stripe[0])))
+		return;
+
+	// A read that lost too many servers is replayed once they are back;
+	// the fault queue entry is only completed after that
+	while (1)
+	{
+		if (!(nr_replicas > 1 ? read_hedged(page, stripe, n, off, len)
+		                      : read_splits(page, stripe, n, off, len)))
+			break;
+		recover_servers();
+	}
+	fetched_bytes += len;
+
+#ifdef PROFILE_READ
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	long total_time = (end_time.tv_sec - start_time.tv_sec) * 1e9 +
+	                  (end_time.tv_nsec - start_time.tv_nsec);
+	fprintf(log_file, "total_time %ld\n", total_time);
+	fflush(log_file);
+#endif
+	// Print the fetched data as a string
+	// printf("Fetched data: %s\n", buffer);
+}
+
+void check_servers();
+
+// Local memory of split j of the page in writeback slot
+char *
+wb_split_local(int slot, int j)
+{
+	char *base = wb_buf + (size_t)slot * wb_slot_size;
+
+	if (nr_replicas > 1)
+		return base;
+	if (j < nr_stripes)
+		return base + j * stripe_size;
+	return base + BUFFER_SIZE + (j - nr_stripes) * stripe_size;
+}
+
+// Send the writeback splits that may go now: their server is up and has
+// room under bulk_max (a split larger than the cap still goes on its own,
+// or it never would), oldest pages first. Each server gets them as a
+// chain in which only the last WR, and every SIGNAL_EVERY-th, is signaled.
+// All addresses are resolved before anything is posted, since a
+// promotion waits for the server's writes to drain; a tiered server only
+// takes a split when it has no other in flight.
+void
+wb_send()
+{
+	struct server *stripe[MAX_SERVERS];
+	uint64_t addr[MAX_SERVERS][WB_SLOTS], bytes[MAX_SERVERS];
+	int plan_slot[MAX_SERVERS][WB_SLOTS], plan_j[MAX_SERVERS][WB_SLOTS], nr_plan[MAX_SERVERS];
+	int order[WB_SLOTS], nr_order = 0;
+	int i, j, k, n, slot, flags;
+
+	// busy slots by age
+	for (i = 0; i < WB_SLOTS; i++)
+	{
+		if (!wb[i].all || wb[i].posted == wb[i].all)
+			continue;
+		for (k = nr_order; k > 0 && wb[order[k - 1]].seq > wb[i].seq; k--)
+			order[k] = order[k - 1];
+		order[k] = i;
+		nr_order++;
+	}
+	for (i = 0; i < nr_servers; i++)
+	{
+		bytes[i] = servers[i].bulk_bytes;
+		nr_plan[i] = 0;
+	}
+
+	for (k = 0; k < nr_order; k++)
+	{
+		slot = order[k];
+		n = page_stripes(wb[slot].page, stripe);
+		for (j = 0; j < n; j++)
+		{
+			struct server *s = stripe[j];
+			int si = s - servers;
+
+			if ((wb[slot].posted & (1u << j)) || s->failed)
+				continue;
+			if (bytes[si] && (bytes[si] + stripe_len(j) > bulk_max || s->page_slot))
+				continue;
+			addr[si][nr_plan[si]] = remote_page_addr(s, wb[slot].page);
+			if (s->failed)
+				continue;
+			plan_slot[si][nr_plan[si]] = slot;
+			plan_j[si][nr_plan[si]] = j;
+			nr_plan[si]++;
+			bytes[si] += stripe_len(j);
+		}
+	}
+
+	for (i = 0; i < nr_servers; i++)
+	{
+		struct server *s = &servers[i];
+
+		for (k = 0; k < nr_plan[i]; k++)
+		{
+			slot = plan_slot[i][k];
+			j = plan_j[i][k];
+			flags = k == nr_plan[i] - 1 || (k + 1) % SIGNAL_EVERY == 0 ? IBV_SEND_SIGNALED : 0;
+			if (post_add(s, WR_WB | ((s->wb_posted + k) & 0xff), IBV_WR_RDMA_WRITE_WITH_IMM,
+			             addr[i][k], wb_split_local(slot, j), stripe_len(j),
+			             IMM_ENCODE(IMM_OP_PAGE_WRITE, server_page(s, wb[slot].page)), flags))
+				break;
+		}
+		if (k < nr_plan[i] || post_flush(s))
+			continue;
+		for (k = 0; k < nr_plan[i]; k++)
+		{
+			slot = plan_slot[i][k];
+			j = plan_j[i][k];
+			s->wb_fifo[s->wb_posted++ % WB_SLOTS] = slot;
+			s->bulk_bytes += stripe_len(j);
+			wb[slot].posted |= 1u << j;
+		}
+	}
+}
+
+// The split of writeback slot on s has landed
+void
+wb_done(struct server *s, int slot)
+{
+	struct wb_slot *w = &wb[slot];
+	struct server *stripe[MAX_SERVERS];
+	int j, n;
+
+	n = page_stripes(w->page, stripe);
+	for (j = 0; j < n && stripe[j] != s; j++)
+		;
+	if (j == n)
+		return;
+	s->bulk_bytes -= stripe_len(j);
+	w->done |= 1u << j;
+	if (w->done == w->all)
+	{
+		w->all = 0;
+		wb_busy--;
+		writebacks++;
+	}
+}
+
+// s lost its connection: whatever it had not confirmed is sent again
+// once it is back
+void
+wb_forget(struct server *s)
+{
+	struct server *stripe[MAX_SERVERS];
+	int i, j, n;
+
+	for (i = 0; i < WB_SLOTS; i++)
+	{
+		if (!wb[i].all)
+			continue;
+		n = page_stripes(wb[i].page, stripe);
+		for (j = 0; j < n; j++)
+		{
+			if (stripe[j] == s)
+				wb[i].posted &= wb[i].done | ~(1u << j);
+		}
+	}
+	s->bulk_bytes = 0;
+	s->wb_retired = s->wb_posted;
+}
+
+// Move writeback along: reap completions and send what the cap allows now
+void
+wb_progress()
+{
+	int i;
+
+	if (!wb_busy)
+		return;
+	for (i = 0; i < nr_servers; i++)
+	{
+		if (servers[i].bulk_bytes)
+			drain_cq(&servers[i]);
+	}
+	wb_send();
+}
+
+// Serve page from the newest writeback still holding it: the remote copy
+// may not have all of it yet
+bool
+wb_lookup(uint32_t page)
+{
+	int i, found = -1;
+
+	for (i = 0; i < WB_SLOTS; i++)
+	{
+		if (wb[i].all && wb[i].page == page && (found < 0 || wb[i].seq > wb[found].seq))
+			found = i;
+	}
+	if (found < 0)
+		return false;
+	fence_stray(NULL, buffer, BUFFER_SIZE);
+	memcpy(buffer, wb_buf + (size_t)found * wb_slot_size, BUFFER_SIZE);
+	return true;
+}
+
+// Slot to write page back from: one holding it that has not sent anything
+// yet is simply overwritten, else a free one. -1 if all are busy.
+int
+wb_slot(uint32_t page)
+{
+	int i, found = -1;
+
+	for (i = 0; i < WB_SLOTS; i++)
+	{
+		if (wb[i].all && wb[i].page == page && !wb[i].posted)
+			return i;
+		if (!wb[i].all && found < 0)
+			found = i;
+	}
+	return found;
+}
+
+// Wait until every writeback has landed
+void
+wb_flush()
+{
+	while (wb_busy)
+	{
+		wb_progress();
+		check_servers();
+	}
+}
+
+// Write the staging buffer back to remote page on its owner (every stripe
+// to its server, or every replica) and tell the server which page now
+// holds data (a file-backed server keeps it across restarts). The page is
+// copied into a writeback slot and sent in the background over the bulk
+// connections; this only waits when all slots are busy.
+void
+write_page(uint32_t page)
+{
+	struct server *stripe[MAX_SERVERS];
+	uint8_t *split[MAX_SERVERS];
+	int j, n, slot;
+	const char *request = "Request from server!";
+	fence_stray(NULL, buffer, BUFFER_SIZE);
+	strcpy(buffer, request);
+#ifdef PROFILE
+	struct timespec start_time, end_time, time1, time2, time3, time4, time5;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+#endif
+	n = page_stripes(page, stripe);
+	// a batch slot holding the old contents must not serve a later fault
+	if (page >= batch_first && page < batch_first + batch_count)
+		batch_count = 0;
+	while ((slot = wb_slot(page)) < 0)
+	{
+		wb_progress();
+		check_servers();
+	}
+	memcpy(wb_split_local(slot, 0), buffer, BUFFER_SIZE);
+	for (j = 0; j < n; j++)
+		split[j] = (uint8_t *)wb_split_local(slot, j);
+	if (nr_parity)
+		ec_encode(&code, split, split + nr_stripes, stripe_size);
+	if (!wb[slot].all)
+		wb_busy++;
+	wb[slot].page = page;
+	wb[slot].all = (1u << n) - 1;
+	wb[slot].posted = 0;
+	wb[slot].done = 0;
+	wb[slot].seq = ++wb_seq;
+	// nor a pushed copy; pushes arriving from now on see wb_pending()
+	for (j = 0; j < n; j++)
+		landing_drop(stripe[j], page);
+	wb_send();
+
+#ifdef PROFILE
+	clock_gettime(CLOCK_MONOTONIC, &end_time); // unlock
+#endif
+
+#ifdef PROFILE
+	// log
+	long total_time = (end_time.tv_sec - start_time.tv_sec) * 1e9 +
+	                  (end_time.tv_nsec - start_time.tv_nsec);
+	fprintf(log_file, "total_time %ld\n", total_time);
+	fflush(log_file);
+#endif
+}
+
+// Event thread: turn signals into ring entries. Signals of one kind
+// coalesce while pending anyway, so one that finds the ring full is dropped.
+void *
+event_thread(void *arg)
+{
+	struct signalfd_siginfo si;
+	uint32_t head;
+
+	while (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+	{
+		head = atomic_load_explicit(&events.head, memory_order_relaxed);
+		if (head - atomic_load_explicit(&events.tail, memory_order_acquire) == EVENT_RING_SIZE)
+		{
+			fprintf(stderr, "Event ring full, dropping signal %u\n", si.ssi_signo);
+			continue;
+		}
+		events.type[head % EVENT_RING_SIZE] = si.ssi_signo == SIGINT ? EV_SIGINT : EV_SIGIO;
+		atomic_store_explicit(&events.head, head + 1, memory_order_release);
+	}
+	return NULL;
+}
+
+// Block the signals the client acts on and start the event thread that
+// reads them. Threads created later inherit the mask.
+int
+start_event_thread()
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+#ifdef UVM
+	sigaddset(&mask, SIGIO);
+#endif
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+	{
+		perror("pthread_sigmask");
+		return -1;
+	}
+	sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (sig_fd < 0)
+	{
+		perror("signalfd");
+		return -1;
+	}
+	if (pthread_create(&event_tid, NULL, event_thread, NULL))
+	{
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+// Act on what the event thread handed over, from the fault loop. Returns
+// true if the client should exit. SIGIOs pending together get one
+// FAULT_HANDLED: signals coalesce anyway, so the driver cannot count them.
+bool
+handle_events()
+{
+	uint32_t tail = atomic_load_explicit(&events.tail, memory_order_relaxed);
+	bool stop = false;
+#ifdef UVM
+	bool handled = false;
+#endif
+
+	while (tail != atomic_load_explicit(&events.head, memory_order_acquire))
+	{
+		switch (events.type[tail % EVENT_RING_SIZE])
+		{
+		case EV_SIGINT:
+			printf("SIGINT received. Sending request to server...\n");
+			write_page(0);
+#ifdef EXIT
+			stop = true;
+#endif
+			break;
+#ifdef UVM
+		case EV_SIGIO:
+			if (!((uint64_t *)buffer)[0])
+				printf("Invalid address -- sigio\n"); // read_buffer
+			handled = true;
+			break;
+#endif
+		}
+		atomic_store_explicit(&events.tail, ++tail, memory_order_release);
+	}
+#ifdef UVM
+	if (handled)
+	{
+		ret = ioctl(fd, FAULT_HANDLED);
+		if (ret == -1)
+			printf("FAULT_HANDLED failed\n");
+	}
+#endif
+	return stop;
+}
+
+// Remote page of the fault i slots after next_task: from its address with
+// the stand-in, else the next of the pages taken in turn
+uint32_t
+task_page(int i)
+{
+	if (emu)
+		return (uintptr_t)queue->buffer[(next_task + i) % QUEUE_SIZE].fault_va / BUFFER_SIZE % REMOTE_PAGENUM;
+	return (next_page + i) % REMOTE_PAGENUM;
+}
+
+// Handle every fault queued from next_task on. Each completes on its own
+// (processed, then its done ring entry); the driver is notified once for
+// the lot. The driver moves tail, so next_task keeps faults from being
+// handled twice while it has not caught up yet.
+void
+handle_faults()
+{
+	int head = queue->head, tail = queue->tail, n = 0, queued, ahead;
+	uint32_t done_head;
+
+	// restart at tail if the driver moved past (or reset) our position
+	if (next_task < 0 ||
+	    (next_task - tail + QUEUE_SIZE) % QUEUE_SIZE > (head - tail + QUEUE_SIZE) % QUEUE_SIZE)
+		next_task = tail;
+	for (; next_task != head; next_task = (next_task + 1) % QUEUE_SIZE)
+	{
+		struct fault_task *task = &queue->buffer[next_task];
+		uint64_t start = emu ? now_ns() : 0;
+		uint32_t page = task_page(0);
+
+		// the faults queued right behind it that are on the pages after it
+		queued = (head - next_task + QUEUE_SIZE) % QUEUE_SIZE;
+		for (ahead = 0; ahead + 1 < queued && ahead + 1 < COALESCE_MAX; ahead++)
+		{
+			if (task_page(ahead + 1) != page + ahead + 1)
+				break;
+		}
+		read_page(page, (uintptr_t)task->fault_va % BUFFER_SIZE, ahead);
+		next_page++;
+		task->processed = 1;
+		__sync_synchronize();
+		faults_done++;
+		if (emu)
+		{
+			pickup_ns += start - emu->enqueued_ns[next_task];
+			handled_ns += now_ns() - emu->enqueued_ns[next_task];
+		}
+		if (!done_ring)
+			continue;
+		// the ring holds more than the queue, so it is only full if the
+		// driver stopped reading it
+		done_head = done_ring->head;
+		if (done_head - done_ring->tail == DONE_RING_SIZE)
+			continue;
+		done_ring->slot[done_head % DONE_RING_SIZE] = next_task;
+		__sync_synchronize();
+		done_ring->head = done_head + 1;
+		n++;
+	}
+	if (n && !done_ring->polling)
+	{
+		if (ioctl(queue_fd, FAULT_HANDLED_BATCH, n) == -1)
+			perror("FAULT_HANDLED_BATCH");
+		done_notifies++;
+	}
+}
+
+// Allocate and register a landing ring for s and advertise it to the server
+int
+setup_landing(struct server *s)
+{
+	struct landing_msg msg;
+
+	if (huge_alloc(&s->landing_mem, (size_t)landing_slots * BUFFER_SIZE, 0))
+		return -1;
+	s->landing = s->landing_mem.addr;
+	topo_bind_memory(s->landing, s->landing_mem.size, nic_node);
+	if (regmem_register(&s->landing_rm, s->pd, s->landing, (size_t)landing_slots * BUFFER_SIZE,
+	                    REGMEM_CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE, 0))
+	{
+		fprintf(stderr, "%s: failed to register landing ring\n", s->name);
+		return -1;
+	}
+	if (s->landing_rm.nr_chunks != 1)
+	{
+		fprintf(stderr, "Landing ring needs a single MR\n");
+		return -1;
+	}
+
+	msg.hdr.type = CTRL_LANDING;
+	msg.hdr.len = sizeof(msg);
+	msg.addr = (uintptr_t)s->landing;
+	msg.rkey = regmem_chunk(&s->landing_rm, 0)->rkey;
+	msg.nr_slots = landing_slots;
+	msg.slot_size = BUFFER_SIZE;
+	send_ctrl(s, &msg, sizeof(msg));
+	printf("%s: push-prefetch into %d landing slots\n", s->name, landing_slots);
+	return 0;
+}
+
+// Parse host[:port] into addr and its canonical name
+int
+parse_addr(const char *arg, struct sockaddr_in *addr, char *name, size_t name_len)
+{
+	char host[INET_ADDRSTRLEN];
+	const char *colon = strrchr(arg, ':');
+	size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+	int port = colon ? atoi(colon + 1) : DEFAULT_PORT;
+
+	if (len >= sizeof(host) || port <= 0 || port > 65535)
+		return -1;
+	memcpy(host, arg, len);
+	host[len] = '\0';
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+		return -1;
+	snprintf(name, name_len, "%s:%d", host, port);
+	return 0;
+}
+
+// Parse host[:port] into the next servers[] entry
+int
+add_server(const char *arg)
+{
+	struct server *s = &servers[nr_servers];
+
+	if (nr_servers == MAX_SERVERS)
+		return -1;
+	memset(s, 0, sizeof(*s));
+	if (parse_addr(arg, &s->addr, s->name, sizeof(s->name)))
+		return -1;
+	s->promote_failed = PAGE_NONE;
+	nr_servers++;
+	return 0;
+}
+
+// A CM event outside connection setup: a disconnect takes its server out
+// of service right away rather than on the next failed work request
+void
+handle_cm_event(struct rdma_cm_event *event)
+{
+	int i;
+
+	for (i = 0; i < nr_servers; i++)
+	{
+		if (servers[i].conn != event->id && servers[i].bulk != event->id)
+			continue;
+		if (event->event == RDMA_CM_EVENT_DISCONNECTED ||
+		    event->event == RDMA_CM_EVENT_DEVICE_REMOVAL)
+			server_failed(&servers[i], rdma_event_str(event->event));
+	}
+	rdma_ack_cm_event(event);
+}
+
+// Handle pending CM events without blocking
+void
+poll_cm_events()
+{
+	struct rdma_cm_event *event;
+
+	while (!rdma_get_cm_event(ec, &event))
+		handle_cm_event(event);
+}
+
+// Wait up to CM_TIMEOUT_MS for the next CM event of connection id to s and
+// check that it is the one expected. Events of other connections are
+// handled meanwhile.
+int
+expect_event(struct rdma_event_channel *ec, struct server *s, struct rdma_cm_id *id,
+             enum rdma_cm_event_type type, struct rdma_cm_event **event)
+{
+	struct pollfd pfd = {.fd = ec->fd, .events = POLLIN};
+
+	while (1)
+	{
+		if (rdma_get_cm_event(ec, event))
+		{
+			if (errno != EAGAIN)
+			{
+				perror("rdma_get_cm_event");
+				return -1;
+			}
+			if (poll(&pfd, 1, CM_TIMEOUT_MS) <= 0)
+			{
+				fprintf(stderr, "%s: timed out waiting for %s\n", s->name, rdma_event_str(type));
+				return -1;
+			}
+			continue;
+		}
+		if ((*event)->id == id)
+			break;
+		handle_cm_event(*event);
+	}
+	if ((*event)->event != type)
+	{
+		fprintf(stderr, "%s: unexpected event: %s\n", s->name, rdma_event_str((*event)->event));
+		rdma_ack_cm_event(*event);
+		return -1;
+	}
+	return 0;
+}
+
+// Create connection *id to s and resolve its address and route, with type
+// of service tos unless it is -1
+int
+resolve_id(struct rdma_event_channel *ec, struct server *s, struct rdma_cm_id **id, int tos)
+{
+	struct rdma_cm_event *event;
+	uint8_t tos_byte = tos;
+
+	printf("%s: creating RDMA ID...\n", s->name);
+	if (rdma_create_id(ec, id, NULL, RDMA_PS_TCP))
+	{
+		perror("rdma_create_id");
+		return -1;
+	}
+	if (tos >= 0 && rdma_set_option(*id, RDMA_OPTION_ID, RDMA_OPTION_ID_TOS, &tos_byte, sizeof(tos_byte)))
+		perror("rdma_set_option");
+
+	printf("%s: resolving address...\n", s->name);
+	if (rdma_resolve_addr(*id, NULL, (struct sockaddr *)&s->addr, 2000))
+	{
+		perror("rdma_resolve_addr");
+		return -1;
+	}
+	if (expect_event(ec, s, *id, RDMA_CM_EVENT_ADDR_RESOLVED, &event))
+		return -1;
+	rdma_ack_cm_event(event);
+
+	printf("%s: resolving route...\n", s->name);
+	if (rdma_resolve_route(*id, 2000))
+	{
+		perror("rdma_resolve_route");
+		return -1;
+	}
+	if (expect_event(ec, s, *id, RDMA_CM_EVENT_ROUTE_RESOLVED, &event))
+		return -1;
+	rdma_ack_cm_event(event);
+	return 0;
+}
+
+// Resolve the address and route of s; the device it resolves to is known
+// afterwards
+int
+resolve_server(struct rdma_event_channel *ec, struct server *s)
+{
+	return resolve_id(ec, s, &s->conn, tos_demand);
+}
+
+// Take the server's answer from the accept. An old server answers with an
+// mr_info. Without a control channel the region is taken as one MR of the
+// size the server reports, and nothing needs promoting.
+int
+server_hello(struct server *s, struct rdma_cm_event *event)
+{
+	const void *data = event->param.conn.private_data;
+	size_t len = event->param.conn.private_data_len;
+	char msg_buf[sizeof(struct mr_table_msg) + sizeof(struct mr_chunk_entry)];
+	struct mr_table_msg *table = (struct mr_table_msg *)msg_buf;
+	struct hello_msg hello;
+	struct mr_info legacy;
+
+	if (!data)
+	{
+		fprintf(stderr, "Private data is NULL\n");
+		return -1;
+	}
+	memset(&hello, 0, sizeof(hello));
+	memcpy(&hello, data, len < sizeof(hello) ? len : sizeof(hello));
+	if (hello.magic != HELLO_MAGIC)
+	{
+		memset(&legacy, 0, sizeof(legacy));
+		memcpy(&legacy, data, len < sizeof(legacy) ? len : sizeof(legacy));
+		printf("%s: pre-handshake server\n", s->name);
+		memset(&hello, 0, sizeof(hello));
+		hello.addr = legacy.remote_addr;
+		hello.rkey = legacy.rkey;
+		hello.mem_size = legacy.mem_size;
+		hello.page_sizes = BUFFER_SIZE;
+	}
+	if (hello.page_sizes != BUFFER_SIZE)
+	{
+		fprintf(stderr, "%s: server settled on %lu byte pages\n", s->name, hello.page_sizes);
+		return -1;
+	}
+	s->server_addr = hello.addr;
+	s->server_rkey = hello.rkey;
+	s->max_rd = hello.max_rd ? hello.max_rd : 1;
+	s->features = hello.features;
+	if (s->features & FEAT_CTRL)
+		return 0;
+
+	table->base = hello.addr;
+	table->chunk_size = hello.mem_size ? hello.mem_size : REMOTE_SIZE;
+	table->nr_chunks = 1;
+	table->first = 0;
+	table->count = 1;
+	table->entries[0].addr = hello.addr;
+	table->entries[0].len = table->chunk_size;
+	table->entries[0].rkey = hello.rkey;
+	table->entries[0].flags = 0;
+	update_chunk_table(s, table);
+	s->region_known = 1;
+	return 0;
+}
+
+// Open the low-priority connection to s, sharing the PD and CQ of the
+// demand connection. The server adds it to our session.
+int
+connect_bulk(struct rdma_event_channel *ec, struct server *s)
+{
+	struct rdma_conn_param cm_params = {0};
+	struct ibv_qp_init_attr qp_attr;
+	struct rdma_cm_event *event;
+	struct hello_msg hello;
+	int i;
+
+	if (resolve_id(ec, s, &s->bulk, tos_bulk))
+		return -1;
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_type = IBV_QPT_RC;
+	qp_attr.send_cq = s->cq;
+	qp_attr.recv_cq = s->cq;
+	qp_attr.cap.max_send_wr = 16;
+	qp_attr.cap.max_recv_wr = BULK_RECV_SLOTS;
+	qp_attr.cap.max_send_sge = 1;
+	qp_attr.cap.max_recv_sge = 1;
+	if (create_qp(s, s->bulk, &qp_attr, &s->bulk_qpx))
+	{
+		perror("rdma_create_qp");
+		return -1;
+	}
+	for (i = 0; i < BULK_RECV_SLOTS; i++)
+	{
+		if (post_bulk_receive(s))
+			return -1;
+	}
+
+	memset(&hello, 0, sizeof(hello));
+	hello.magic = HELLO_MAGIC;
+	hello.version = HELLO_VERSION;
+	hello.len = sizeof(hello);
+	hello.qp_class = QP_CLASS_BULK;
+	hello.features = FEAT_BULK_QP;
+	cm_params.private_data = &hello;
+	cm_params.private_data_len = sizeof(hello);
+	cm_params.responder_resources = 1;
+	cm_params.initiator_depth = 1;
+	cm_params.rnr_retry_count = 7;
+	if (rdma_connect(s->bulk, &cm_params))
+	{
+		perror("rdma_connect");
+		return -1;
+	}
+	if (expect_event(ec, s, s->bulk, RDMA_CM_EVENT_ESTABLISHED, &event))
+		return -1;
+	rdma_ack_cm_event(event);
+	printf("%s: bulk connection up\n", s->name);
+	return 0;
+}
+
+// Set up the PD, buffer registration, CQ and QP of s and connect to it
+int
+connect_server(struct rdma_event_channel *ec, struct server *s)
+{
+	struct ibv_qp_init_attr qp_attr;
+	struct ibv_device_attr dev_attr;
+	struct ibv_port_attr port_attr;
+	struct rdma_cm_event *event;
+	struct hello_msg hello;
+
+	// Allocate Protection Domain
+	s->pd = ibv_alloc_pd(s->conn->verbs);
+	if (!s->pd)
+	{
+		perror("ibv_alloc_pd");
+		return -1;
+	}
+
+	if (regmem_register(&s->staging, s->pd, buffer, BUFFER_SIZE, REGMEM_CHUNK_SIZE,
+	                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ, 0))
+	{
+		fprintf(stderr, "%s: failed to register buffer\n", s->name);
+		return -1;
+	}
+
+	if (regmem_register(&s->wb_rm, s->pd, wb_buf, WB_SLOTS * wb_slot_size, REGMEM_CHUNK_SIZE,
+	                    IBV_ACCESS_LOCAL_WRITE, 0))
+	{
+		fprintf(stderr, "%s: failed to register writeback slots\n", s->name);
+		return -1;
+	}
+
+	if (batch && regmem_register(&s->batch_rm, s->pd, batch, COALESCE_MAX * BUFFER_SIZE,
+	                             REGMEM_CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE, 0))
 	{
-		perror("ibv_post_recv");
-		exit(1);
+		fprintf(stderr, "%s: failed to register batch slots\n", s->name);
+		return -1;
 	}
-}
 
-void
-read_page(uintptr_t addr)
-{
-	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
-	struct ibv_sge send_sge;
-	struct ibv_wc wc;
-#ifdef PROFILE_READ
-	struct timespec start_time, end_time;
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
-#endif
-	// Initialize the send work request
-	memset(&send_wr, 0, sizeof(send_wr));
-	send_wr.wr_id = 1;
-	send_wr.opcode = IBV_WR_RDMA_READ;
-	send_wr.send_flags = IBV_SEND_SIGNALED;
-	send_wr.wr.rdma.remote_addr = addr;
-	send_wr.wr.rdma.rkey = server_rkey;
-	send_sge.addr = (uintptr_t)buffer;
-	send_sge.length = BUFFER_SIZE;
-	send_sge.lkey = mr->lkey;
-	send_wr.sg_list = &send_sge;
-	send_wr.num_sge = 1;
+	if (hedge_buf && regmem_register(&s->hedge_rm, s->pd, hedge_slot(s), BUFFER_SIZE,
+	                                 REGMEM_CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE, 0))
+	{
+		fprintf(stderr, "%s: failed to register hedge slot\n", s->name);
+		return -1;
+	}
 
-	// Post the RDMA read request
-	if (ibv_post_send(conn->qp, &send_wr, &bad_send_wr))
+	if (nr_parity && regmem_register(&s->parity_rm, s->pd, parity_buf, nr_parity * stripe_size,
+	                                 REGMEM_CHUNK_SIZE, IBV_ACCESS_LOCAL_WRITE, 0))
 	{
-		perror("ibv_post_send");
-		exit(1);
+		fprintf(stderr, "%s: failed to register parity buffer\n", s->name);
+		return -1;
 	}
 
-	// Wait for send completion
-	while (ibv_poll_cq(cq, 1, &wc) < 1)
+	s->ctrl_buf = malloc((CTRL_RECV_SLOTS + 1) * CTRL_MSG_SIZE);
+	if (!s->ctrl_buf)
 	{
+		perror("malloc");
+		return -1;
 	}
-	if (wc.status != IBV_WC_SUCCESS)
+	s->ctrl_mr = ibv_reg_mr(s->pd, s->ctrl_buf, (CTRL_RECV_SLOTS + 1) * CTRL_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+	if (!s->ctrl_mr)
 	{
-		fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-		        ibv_wc_status_str(wc.status), wc.status, (int)wc.wr_id);
-		exit(1);
+		perror("ibv_reg_mr");
+		return -1;
 	}
 
-#ifdef PROFILE_READ
-	clock_gettime(CLOCK_MONOTONIC, &end_time);
-	long total_time = (end_time.tv_sec - start_time.tv_sec) * 1e9 +
-	                  (end_time.tv_nsec - start_time.tv_nsec);
-	fprintf(log_file, "total_time %ld\n", total_time);
-	fflush(log_file);
-#endif
-	// Print the fetched data as a string
-	// printf("Fetched data: %s\n", buffer);
-}
+	if (spin_ns >= 0)
+	{
+		s->comp_chan = ibv_create_comp_channel(s->conn->verbs);
+		if (!s->comp_chan)
+		{
+			perror("ibv_create_comp_channel");
+			return -1;
+		}
+	}
+	s->cq_armed = 0;
+	s->idle_since = 0;
+	s->cq = ibv_create_cq(s->conn->verbs, 64, NULL, s->comp_chan, 0); // demand and bulk QP
+	if (!s->cq)
+	{
+		perror("ibv_create_cq");
+		return -1;
+	}
 
-// Function to send a request and receive a response
-void
-write_page()
-{
-	const char *request = "Request from server!";
-	strcpy(buffer, request);
-#ifdef PROFILE
-	struct timespec start_time, end_time, time1, time2, time3, time4, time5;
-	clock_gettime(CLOCK_MONOTONIC, &start_time);
-#endif
-	pthread_mutex_lock(&send_receive_mutex);
-	atomic_store(&send_receive_in_progress, true);
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_type = IBV_QPT_RC;
+	qp_attr.send_cq = s->cq;
+	qp_attr.recv_cq = s->cq;
+	qp_attr.cap.max_send_wr = 16;
+	qp_attr.cap.max_recv_wr = 16;
+	qp_attr.cap.max_send_sge = 1;
+	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.cap.max_inline_data = CTRL_INLINE;
+	if (create_qp(s, s->conn, &qp_attr, &s->qpx))
+	{
+		perror("rdma_create_qp");
+		return -1;
+	}
+	s->max_inline = qp_attr.cap.max_inline_data;
+	init_post(s);
+	printf("%s: posting with %s\n", s->name, s->qpx ? "ibv_wr_*" : "ibv_post_send");
 
-	// Post RDMA Write with Immediate Data request to server
-	// printf("Post Write Message\n");
-	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
-	struct ibv_sge send_sge;
-	memset(&send_wr, 0, sizeof(send_wr));
-	send_wr.wr_id = 1;
-	send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-	send_wr.send_flags = IBV_SEND_SIGNALED;
-	send_wr.wr.rdma.remote_addr = server_addr;
-	send_wr.wr.rdma.rkey = server_rkey;
-	send_sge.addr = (uintptr_t)buffer;
-	send_sge.length = BUFFER_SIZE;
-	// send_sge.length = strlen(buffer);
-	send_sge.lkey = mr->lkey;
-	send_wr.sg_list = &send_sge;
-	send_wr.num_sge = 1;
-	if (ibv_post_send(conn->qp, &send_wr, &bad_send_wr))
+	// The server sends its chunk table right after the connection is up
+	for (int i = 0; i < CTRL_RECV_SLOTS; i++)
 	{
-		perror("ibv_post_send");
-		exit(1);
+		if (post_receive(s, i))
+			return -1;
 	}
 
-	// Wait for send completion
-	// printf("Waitfor send completion ...\n");
-	struct ibv_wc wc;
-	while (ibv_poll_cq(cq, 1, &wc) < 1)
+	// Every server provisions only the pages it holds
+	printf("%s: connecting...\n", s->name);
+	struct rdma_conn_param cm_params = {0};
+	memset(&hello, 0, sizeof(hello));
+	hello.magic = HELLO_MAGIC;
+	hello.version = HELLO_VERSION;
+	hello.len = sizeof(hello);
+	hello.addr = (uintptr_t)buffer;
+	hello.rkey = regmem_chunk(&s->staging, 0)->rkey;
+	hello.mem_size = s->nr_owned ? (s->nr_owned + splits_per_page - 1) / splits_per_page * BUFFER_SIZE
+	                             : BUFFER_SIZE;
+	hello.page_sizes = BUFFER_SIZE; // a power of two is its own mask
+	hello.max_rd = MAX_RD;
+	if (!ibv_query_device(s->conn->verbs, &dev_attr) && dev_attr.max_qp_init_rd_atom < MAX_RD)
+		hello.max_rd = dev_attr.max_qp_init_rd_atom;
+	s->max_msg = BUFFER_SIZE;
+	if (!ibv_query_port(s->conn->verbs, s->conn->port_num, &port_attr))
+		s->max_msg = port_attr.max_msg_sz;
+	hello.features = FEAT_CTRL | FEAT_NOTIFY | FEAT_TIERING | FEAT_BULK_QP |
+	                 (landing_slots ? FEAT_LANDING : 0);
+	cm_params.private_data = &hello;
+	cm_params.private_data_len = sizeof(hello);
+	cm_params.responder_resources = 1;
+	cm_params.initiator_depth = hello.max_rd;
+	cm_params.rnr_retry_count = 7; // notifications may briefly outrun the server's receives
+	if (rdma_connect(s->conn, &cm_params))
 	{
+		perror("rdma_connect");
+		return -1;
 	}
-	if (wc.status != IBV_WC_SUCCESS)
+	if (expect_event(ec, s, s->conn, RDMA_CM_EVENT_ESTABLISHED, &event))
+		return -1;
+	if (server_hello(s, event))
 	{
-		fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-		        ibv_wc_status_str(wc.status), wc.status, (int)wc.wr_id);
-		exit(1);
+		rdma_ack_cm_event(event);
+		return -1;
 	}
+	rdma_ack_cm_event(event);
+	printf("%s: addr %lx, rkey %u, %d outstanding reads, features %x\n", s->name,
+	       s->server_addr, s->server_rkey, s->max_rd, s->features);
 
-	// Clear the atomic flag
-	atomic_store(&send_receive_in_progress, false);
-	pthread_mutex_unlock(&send_receive_mutex);
-
-#ifdef PROFILE
-	clock_gettime(CLOCK_MONOTONIC, &end_time); // unlock
-#endif
+	// Wait for the first table entries so read_page() has keys to use
+	remote_rkey(s, s->server_addr);
+	printf("%s: %u chunks of %lu bytes\n", s->name, s->nr_chunks, s->chunk_size);
 
-#ifdef PROFILE
-	// log
-	long total_time = (end_time.tv_sec - start_time.tv_sec) * 1e9 +
-	                  (end_time.tv_nsec - start_time.tv_nsec);
-	fprintf(log_file, "total_time %ld\n", total_time);
-	fflush(log_file);
-#endif
+	if ((s->features & FEAT_LANDING) && setup_landing(s))
+		return -1;
+	if ((s->features & FEAT_BULK_QP) && connect_bulk(ec, s))
+		return -1;
+	return 0;
 }
 
+// Release the connection to s and everything registered with it. Its name,
+// address and counters stay for a reconnect.
 void
-sigint_handler(int signum)
+teardown_server(struct server *s)
 {
-	printf("SIGINT received. Sending request to server...\n");
-	// read_page(server_addr + (next_page % REMOTE_PAGENUM) * BUFFER_SIZE);
-	// next_page++;
-	write_page();
-#ifdef EXIT
-	exit_requested = true;
-#endif
+	if (s->conn)
+	{
+		rdma_disconnect(s->conn);
+		if (s->conn->qp)
+			rdma_destroy_qp(s->conn);
+	}
+	if (s->bulk)
+	{
+		rdma_disconnect(s->bulk);
+		if (s->bulk->qp)
+			rdma_destroy_qp(s->bulk);
+		rdma_destroy_id(s->bulk);
+	}
+	wb_forget(s);
+	if (s->cq)
+		ibv_destroy_cq(s->cq);
+	if (s->comp_chan)
+		ibv_destroy_comp_channel(s->comp_chan);
+	s->comp_chan = NULL;
+	regmem_release(&s->staging);
+	regmem_release(&s->parity_rm);
+	regmem_release(&s->batch_rm);
+	regmem_release(&s->hedge_rm);
+	regmem_release(&s->wb_rm);
+	regmem_release(&s->landing_rm);
+	huge_free(&s->landing_mem);
+	if (s->ctrl_mr)
+		ibv_dereg_mr(s->ctrl_mr);
+	free(s->ctrl_buf);
+	free(s->chunks);
+	free(s->chunk_valid);
+	free(s->page_slot);
+	if (s->pd)
+		ibv_dealloc_pd(s->pd);
+	if (s->conn)
+		rdma_destroy_id(s->conn);
+
+	s->conn = NULL;
+	s->bulk = NULL;
+	s->cq = NULL;
+	s->ctrl_mr = NULL;
+	s->ctrl_buf = NULL;
+	s->chunks = NULL;
+	s->chunk_valid = NULL;
+	s->nr_chunks = 0;
+	s->chunk_size = 0;
+	s->page_slot = NULL;
+	s->region_known = 0;
+	s->region_flags = 0;
+	s->promote_failed = PAGE_NONE;
+	s->landing_head = s->landing_tail = 0;
+	s->reads_inflight = 0;
+	s->stray_len = 0;
+	s->features = 0;
+	s->pd = NULL;
 }
 
-#ifdef UVM
-void
-sigio_handler(int sig)
+// A standby only has the pages of the server it stands in for if it
+// shares the backing store, which its region reports as persistent and
+// warm. One that does not is given up, loudly, and the server it stood in
+// for is retried again.
+bool
+standby_holds_pages(struct server *s)
+{
+	uint32_t need = REGION_PERSISTENT | REGION_WARM;
+
+	if (!s->on_standby)
+		return true;
+	while (!s->region_known && !s->failed)
+		wait_wr(s, 0);
+	if (s->failed)
+		return false;
+	if ((s->region_flags & need) == need)
+		return true;
+	fprintf(stderr, "%s: standby region is not persistent and warm (flags %x), so it lacks the pages of %s; "
+	        "going back to %s\n", s->name, s->region_flags, s->home_name, s->home_name);
+	s->addr = s->home_addr;
+	memcpy(s->name, s->home_name, sizeof(s->name));
+	s->on_standby = 0;
+	return false;
+}
+
+// One reconnect attempt. The server keeps its region across connections,
+// so the pages are where they were. On failure the next attempt is pushed
+// out exponentially.
+int
+try_reconnect(struct server *s)
 {
-	if (!((uint64_t *)buffer)[0])
+	uint64_t backoff;
+
+	teardown_server(s);
+	if (s->attempts == RECONNECT_STANDBY_AFTER && standby_free)
 	{
-		printf("Invalid address -- sigio\n"); // read_buffer
+		// keeps its place on the ring: the standby serves the same pages
+		printf("%s: failing over to standby %s\n", s->name, standby_name);
+		s->home_addr = s->addr;
+		memcpy(s->home_name, s->name, sizeof(s->home_name));
+		s->addr = standby_addr;
+		snprintf(s->name, sizeof(s->name), "%s", standby_name);
+		s->on_standby = 1;
+		standby_free = 0;
 	}
+	s->attempts++;
+	printf("%s: reconnect attempt %d\n", s->name, s->attempts);
+	s->failed = 0;
+	if (!resolve_server(ec, s) && !connect_server(ec, s) && !s->failed && standby_holds_pages(s))
+	{
+		printf("%s: reconnected\n", s->name);
+		advise_hot_server(s, 0, REMOTE_PAGENUM);
+		s->attempts = 0;
+		return 0;
+	}
+	s->failed = 1;
+	backoff = RECONNECT_MIN_NS << (s->attempts - 1 < 16 ? s->attempts - 1 : 16);
+	if (backoff > RECONNECT_MAX_NS)
+		backoff = RECONNECT_MAX_NS;
+	s->retry_at = now_ns() + backoff;
+	return -1;
+}
+
+// Block until every failed server is back
+void
+recover_servers()
+{
+	struct timespec ts;
+	uint64_t now;
+	int i;
 
-	// Check if send_request_and_receive_response is in progress
-	if (!atomic_load(&send_receive_in_progress))
+	for (i = 0; i < nr_servers; i++)
 	{
+		struct server *s = &servers[i];
 
+		while (s->failed)
+		{
+			now = now_ns();
+			if (now < s->retry_at)
+			{
+				ts.tv_sec = (s->retry_at - now) / 1000000000ULL;
+				ts.tv_nsec = (s->retry_at - now) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+			try_reconnect(s);
+		}
 	}
+}
+
+// Between faults: notice disconnects and retry servers that are due, so
+// redundant layouts get their servers back before a fault needs them
+void
+check_servers()
+{
+	static uint64_t last_check;
+	uint64_t now = now_ns();
+	int i;
 
-	ret = ioctl(fd, FAULT_HANDLED);
-	if (ret == -1)
+	if (now - last_check < CM_CHECK_NS)
+		return;
+	last_check = now;
+	poll_cm_events();
+	for (i = 0; i < nr_servers; i++)
 	{
-		printf("FAULT_HANDLED failed\n");
+		if (servers[i].failed && now >= servers[i].retry_at)
+			try_reconnect(&servers[i]);
 	}
-	printf("sigio_handler done\n");
 }
-#endif
+
+void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s host[:port]]... [-S host[:port]] [-k stripes [-m parity] | -r replicas [-b budget]]\n"
+	                "       [-p landing_slots] [-g size|auto] [-T tos[,tos]] [-B bytes] [-w usec] [-q queue] [-M]\n", prog);
+	fprintf(stderr, "  -s server  memory server to spread remote pages over; repeat for\n");
+	fprintf(stderr, "             up to %d servers (default %s)\n", MAX_SERVERS, DEFAULT_SERVER);
+	fprintf(stderr, "  -S server  standby that takes over a server still down after %d\n", RECONNECT_STANDBY_AFTER);
+	fprintf(stderr, "             reconnect attempts; only used if it reports a persistent,\n");
+	fprintf(stderr, "             warm region (the backing store of the server it replaces)\n");
+	fprintf(stderr, "  -k count   split every remote page into this many stripes on\n");
+	fprintf(stderr, "             distinct servers, read in parallel (default 1)\n");
+	fprintf(stderr, "  -m count   add this many Reed-Solomon parity splits on further\n");
+	fprintf(stderr, "             servers; reads need any k splits and survive the\n");
+	fprintf(stderr, "             loss of m servers\n");
+	fprintf(stderr, "  -r count   keep this many copies of every page on distinct servers\n");
+	fprintf(stderr, "             and hedge slow reads to the next copy\n");
+	fprintf(stderr, "  -b frac    extra hedged reads allowed per demand read (default %.2f)\n", hedge_budget);
+	fprintf(stderr, "  -p slots   let each server push predicted pages into this many\n");
+	fprintf(stderr, "             landing slots (max %d)\n", LANDING_MAX_SLOTS);
+	fprintf(stderr, "  -g size    bytes fetched per fault: 4k, 64k, 2m (default) or a power\n");
+	fprintf(stderr, "             of two in between; auto picks per page from its access\n");
+	fprintf(stderr, "             density. -m always fetches whole pages. Below 2m only with\n");
+	fprintf(stderr, "             the -q stand-in, as the UVM driver installs whole pages\n");
+	fprintf(stderr, "  -T d[,b]   IP type of service (RoCE service level) of the demand and\n");
+	fprintf(stderr, "             the bulk (writeback, push) connections\n");
+	fprintf(stderr, "  -B bytes   writeback bytes in flight per server (default %dm)\n",
+	        BULK_MAX_DEFAULT >> 20);
+	fprintf(stderr, "  -w usec    sleep on the completion channel once a wait has seen no\n");
+	fprintf(stderr, "             completion for usec (default: busy-poll, lowest latency)\n");
+	fprintf(stderr, "  -q path    fault queue to serve (default %s); the memfd path\n", DEVICE_NAME);
+	fprintf(stderr, "             queue_tester -E prints runs against its stand-in\n");
+	fprintf(stderr, "  -M         read runs of queued faults on consecutive pages with one\n");
+	fprintf(stderr, "             READ; each page is then copied out of its batch slot\n");
+	fprintf(stderr, "             (off by default: check with -q that this wins)\n");
+}
+
+// Parse a fetch size such as 4k, 64k or 2m
+size_t
+parse_size(const char *arg)
+{
+	char *end;
+	size_t size = strtoul(arg, &end, 0);
+
+	if (*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20;
+	return size;
+}
 
 int
 main(int argc, char **argv)
 {
-	struct sockaddr_in addr;
-	struct rdma_event_channel *ec = NULL;
-	struct ibv_qp_init_attr qp_attr;
-
-	signal(SIGINT, sigint_handler);
-#ifdef UVM
-	signal(SIGIO, sigio_handler);
-#endif
+	int opt, i;
 
-	// fault queue
-	fd = open(DEVICE_NAME, O_RDWR);
-	if (fd < 0)
+	while ((opt = getopt(argc, argv, "s:S:k:m:r:b:p:g:T:B:w:q:Mh")) != -1)
 	{
-		perror("open");
-		return 1;
+		switch (opt)
+		{
+		case 's':
+			if (add_server(optarg))
+			{
+				fprintf(stderr, "Bad or too many servers: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			if (parse_addr(optarg, &standby_addr, standby_name, sizeof(standby_name)))
+			{
+				fprintf(stderr, "Bad standby: %s\n", optarg);
+				return 1;
+			}
+			standby_free = 1;
+			break;
+		case 'k':
+			nr_stripes = atoi(optarg);
+			if (nr_stripes < 1 || nr_stripes > MAX_SERVERS)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			nr_parity = atoi(optarg);
+			if (nr_parity < 0 || nr_parity >= EC_MAX_SPLITS)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			nr_replicas = atoi(optarg);
+			if (nr_replicas < 1 || nr_replicas > MAX_SERVERS)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			hedge_budget = atof(optarg);
+			if (hedge_budget < 0 || hedge_budget > 1)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			landing_slots = atoi(optarg);
+			if (landing_slots < 0 || landing_slots > LANDING_MAX_SLOTS)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'g':
+			if (!strcmp(optarg, "auto"))
+			{
+				fetch_auto = 1;
+				break;
+			}
+			fetch_size = parse_size(optarg);
+			if (fetch_size < SUBPAGE_SIZE || fetch_size > BUFFER_SIZE || (fetch_size & (fetch_size - 1)))
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%d,%d", &tos_demand, &tos_bulk) < 1 || tos_demand > 255 || tos_bulk > 255)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'B':
+			bulk_max = parse_size(optarg);
+			break;
+		case 'w':
+			spin_ns = atol(optarg) * 1000;
+			break;
+		case 'q':
+			queue_path = optarg;
+			break;
+		case 'M':
+			coalesce = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
 	}
-	queue = mmap(NULL, sizeof(struct fault_queue),
-	             PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (queue == MAP_FAILED)
+	if (!nr_servers)
+		add_server(DEFAULT_SERVER);
+	if (nr_stripes + nr_parity > nr_servers || nr_stripes + nr_parity > EC_MAX_SPLITS)
 	{
-		perror("mmap");
+		fprintf(stderr, "%d splits need as many servers\n", nr_stripes + nr_parity);
 		return 1;
 	}
-	printf("mmap success\n");
-
-#ifdef PROFILE
-	log_file = fopen("write_log.txt", "a");
-	if (!log_file)
+	if (nr_replicas > 1 && (nr_stripes > 1 || nr_parity))
 	{
-		perror("Failed to open log file");
+		fprintf(stderr, "-r does not combine with -k or -m\n");
 		return 1;
 	}
-#endif
-#ifdef PROFILE_READ
-	log_file = fopen("read_log.txt", "a");
-	if (!log_file)
+	if (nr_replicas > nr_servers)
 	{
-		perror("Failed to open log file");
+		fprintf(stderr, "%d replicas need as many servers\n", nr_replicas);
 		return 1;
 	}
-#endif
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(5000);
-	inet_pton(AF_INET, "10.10.10.221", &addr.sin_addr);
-
-	printf("Creating event channel...\n");
-	ec = rdma_create_event_channel();
-	if (!ec)
+	// coded splits are all the same size
+	if (nr_parity && BUFFER_SIZE % (nr_stripes * 4096))
 	{
-		perror("rdma_create_event_channel");
+		fprintf(stderr, "-m needs -k to split a page into whole 4KB pages\n");
 		return 1;
 	}
-
-	printf("Creating RDMA ID...\n");
-	if (rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP))
-	{
-		perror("rdma_create_id");
+	if (nr_parity && ec_init(&code, nr_stripes, nr_parity))
 		return 1;
-	}
-
-	printf("Resolving address...\n");
-	if (rdma_resolve_addr(conn, NULL, (struct sockaddr *)&addr, 2000))
+	// Pushes carry whole pages, which no single server has when striped
+	if (nr_stripes + nr_parity > 1 && landing_slots)
 	{
-		perror("rdma_resolve_addr");
+		fprintf(stderr, "Push-prefetch (-p) does not work with striping (-k)\n");
 		return 1;
 	}
+	// whole 4KB pages per stripe, the last one possibly shorter. A server
+	// packs as many splits as fit whole into each of its pages, so that
+	// tiering and the valid map keep working a page at a time.
+	stripe_size = ((BUFFER_SIZE / nr_stripes + 4095) / 4096) * 4096;
+	splits_per_page = BUFFER_SIZE / stripe_size;
 
-	printf("Getting CM event...\n");
-	struct rdma_cm_event *event;
-	if (rdma_get_cm_event(ec, &event))
+	// Place remote pages
+	chash_init(&ring);
+	for (i = 0; i < nr_servers; i++)
 	{
-		perror("rdma_get_cm_event");
-		return 1;
+		if (chash_add(&ring, servers[i].name, i))
+			return 1;
 	}
-	rdma_ack_cm_event(event);
+	// Pack each server's pages (or splits) at the start of its region. The
+	// packing depends on the server list and -k: a file-backed server (-f
+	// on the server) only finds its pages again under the same ones.
+	for (uint32_t page = 0; page < REMOTE_PAGENUM; page++)
+	{
+		for (i = 0; i < nr_servers; i++)
+		{
+			struct server *s = &servers[i];
 
-	printf("Resolving route...\n");
-	if (rdma_resolve_route(conn, 2000))
+			s->shard_index[page] = PAGE_NONE;
+			if (!page_on_server(page, s))
+				continue;
+			s->shard_index[page] = s->nr_owned;
+			s->shard_page[s->nr_owned++] = page;
+		}
+	}
+	for (i = 0; i < nr_servers; i++)
+		printf("%s: %lu of %d remote pages\n", servers[i].name, servers[i].nr_owned, REMOTE_PAGENUM);
+	if (nr_replicas > 1)
+		printf("Pages replicated %d times, hedge budget %.2f\n", nr_replicas, hedge_budget);
+	else if (nr_parity)
+		printf("Pages erasure coded %d+%d, %zu bytes per split\n", nr_stripes, nr_parity, stripe_size);
+	else if (nr_stripes > 1)
+		printf("Pages striped over %d servers, %zu bytes per stripe\n", nr_stripes, stripe_size);
+	if (fetch_auto)
 	{
-		perror("rdma_resolve_route");
-		return 1;
+		for (i = 0; i < REMOTE_PAGENUM; i++)
+			density[i].fetch_size = 64 * 1024;
+		printf("Fetch size adapts per page, 4KB to 2MB\n");
 	}
+	else if (fetch_size != BUFFER_SIZE && !nr_parity)
+		printf("Fetching %zu bytes per fault\n", fetch_size);
 
-	printf("Getting CM event...\n");
-	if (rdma_get_cm_event(ec, &event))
-	{
-		perror("rdma_get_cm_event");
+	if (start_event_thread())
 		return 1;
-	}
-	rdma_ack_cm_event(event);
 
-	// Allocate Protection Domain
-	printf("Allocating PD...\n");
-	pd = ibv_alloc_pd(conn->verbs);
-	if (!pd)
+	// fault queue
+	queue_fd = open(queue_path, O_RDWR);
+	if (queue_fd < 0)
 	{
-		perror("ibv_alloc_pd");
+		perror(queue_path);
 		return 1;
 	}
-
-	// Allocate buffer using huge pages
-	printf("Allocating buffer...\n");
-	buffer = mmap(NULL, BUFFER_SIZE + EVICTION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
-	if (buffer == MAP_FAILED)
+	queue = mmap(NULL, sizeof(struct fault_queue),
+	             PROT_READ | PROT_WRITE, MAP_SHARED, queue_fd, 0);
+	if (queue == MAP_FAILED)
 	{
 		perror("mmap");
 		return 1;
 	}
-
-	memset(buffer, 0, BUFFER_SIZE);
-	mr = ibv_reg_mr(pd, buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
-	if (!mr)
+	printf("mmap success\n");
+	done_ring = mmap(NULL, sizeof(struct fault_done_ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+	                 queue_fd, DONE_RING_OFFSET);
+	if (done_ring != MAP_FAILED && done_ring->magic != DONE_RING_MAGIC)
 	{
-		perror("ibv_reg_mr");
+		// not the ring: the driver may have mapped the queue itself again
+		munmap(done_ring, sizeof(struct fault_done_ring));
+		done_ring = MAP_FAILED;
+	}
+	if (done_ring == MAP_FAILED)
+	{
+		done_ring = NULL;
+		printf("Fault queue without a completion ring, completing through processed only\n");
+	}
+	if (strcmp(queue_path, DEVICE_NAME))
+	{
+		emu = mmap(NULL, sizeof(struct fault_queue_emu), PROT_READ | PROT_WRITE, MAP_SHARED,
+		           queue_fd, EMU_INFO_OFFSET);
+		if (emu == MAP_FAILED || emu->magic != EMU_MAGIC)
+		{
+			fprintf(stderr, "%s is not a fault queue stand-in\n", queue_path);
+			return 1;
+		}
+		printf("Faults come from the userspace stand-in at %s\n", queue_path);
+	}
+#ifdef UVM
+	if (!emu && !nr_parity && (fetch_auto || fetch_size != BUFFER_SIZE))
+	{
+		fprintf(stderr, "-g below 2m needs the -q stand-in: the UVM driver would install "
+		                "the whole staging buffer, stale around the fetched piece\n");
 		return 1;
 	}
-	printf("Client: key %u\n", mr->rkey);
-	printf("Client: addr %lx\n", (uintptr_t)buffer);
-
-	printf("Creating CQ...\n");
-	cq = ibv_create_cq(conn->verbs, 10, NULL, NULL, 0);
+#endif
 
-	printf("Creating QP...\n");
-	memset(&qp_attr, 0, sizeof(qp_attr));
-	qp_attr.qp_type = IBV_QPT_RC;
-	qp_attr.send_cq = cq;
-	qp_attr.recv_cq = cq;
-	qp_attr.cap.max_send_wr = 10;
-	qp_attr.cap.max_recv_wr = 10;
-	qp_attr.cap.max_send_sge = 1;
-	qp_attr.cap.max_recv_sge = 1;
-	if (rdma_create_qp(conn, pd, &qp_attr))
+#ifdef PROFILE
+	log_file = fopen("write_log.txt", "a");
+	if (!log_file)
 	{
-		perror("rdma_create_qp");
+		perror("Failed to open log file");
 		return 1;
 	}
-
-	printf("Connecting...\n");
-	struct rdma_conn_param cm_params = {0};
-	struct mr_info mr_info = {(uintptr_t)buffer, mr->rkey, REMOTE_SIZE};
-	cm_params.private_data = &mr_info;
-	cm_params.private_data_len = sizeof(mr_info);
-	cm_params.responder_resources = 1;
-	cm_params.initiator_depth = 1;
-	if (rdma_connect(conn, &cm_params))
+#endif
+#ifdef PROFILE_READ
+	log_file = fopen("read_log.txt", "a");
+	if (!log_file)
 	{
-		perror("rdma_connect");
+		perror("Failed to open log file");
 		return 1;
 	}
+#endif
 
-	printf("Getting CM event...\n");
-	if (rdma_get_cm_event(ec, &event))
+	printf("Creating event channel...\n");
+	ec = rdma_create_event_channel();
+	if (!ec)
 	{
-		perror("rdma_get_cm_event");
+		perror("rdma_create_event_channel");
 		return 1;
 	}
+	// setup steps wait with a timeout, and the fault loop checks for
+	// disconnects in passing
+	fcntl(ec->fd, F_SETFL, fcntl(ec->fd, F_GETFL) | O_NONBLOCK);
 
-	if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+	for (i = 0; i < nr_servers; i++)
 	{
-		struct mr_info *server_mr = (struct mr_info *)event->param.conn.private_data;
-		if (server_mr == NULL)
-		{
-			fprintf(stderr, "Private data is NULL\n");
+		if (resolve_server(ec, &servers[i]))
 			return 1;
-		}
-		// Extract server keys
-		memcpy(&server_addr, &server_mr->remote_addr, sizeof(server_addr));
-		memcpy(&server_rkey, &server_mr->rkey, sizeof(server_rkey));
-
-		printf("server_addr: %lx\n", server_addr);
-		printf("server_rkey: %u\n", server_rkey);
 	}
+
+	// Keep registered memory and the polling thread next to the NIC
+	struct ibv_context *verbs = servers[0].conn->verbs;
+	nic_node = topo_device_node(verbs);
+	if (nic_node >= 0 && !topo_pin_thread(pthread_self(), nic_node))
+		printf("%s is on NUMA node %d; fault poller pinned to its %d cpus\n",
+		       ibv_get_device_name(verbs->device), nic_node, topo_node_cpu_count(nic_node));
 	else
+		printf("%s: NUMA node unknown, no placement\n", ibv_get_device_name(verbs->device));
+
+	// Allocate buffer using huge pages
+	printf("Allocating buffer...\n");
+	if (huge_alloc(&buffer_mem, BUFFER_SIZE + EVICTION_SIZE, 0))
+		return 1;
+	buffer = buffer_mem.addr;
+	printf("Buffer: %zu bytes of %s pages\n", buffer_mem.size, huge_kind_str(buffer_mem.kind));
+	// before the memset below faults the pages in
+	if (!topo_bind_memory(buffer, buffer_mem.size, nic_node))
+		printf("Buffer: preferring NUMA node %d\n", nic_node);
+	memset(buffer, 0, BUFFER_SIZE);
+	printf("Client: addr %lx\n", (uintptr_t)buffer);
+	if (nr_parity)
 	{
-		fprintf(stderr, "Unexpected event: %s\n", rdma_event_str(event->event));
+		if (huge_alloc(&parity_mem, nr_parity * stripe_size, 0))
+			return 1;
+		parity_buf = parity_mem.addr;
+		topo_bind_memory(parity_buf, parity_mem.size, nic_node);
+	}
+	wb_slot_size = BUFFER_SIZE + nr_parity * stripe_size;
+	if (huge_alloc(&wb_mem, WB_SLOTS * wb_slot_size, 0))
 		return 1;
+	wb_buf = wb_mem.addr;
+	topo_bind_memory(wb_buf, wb_mem.size, nic_node);
+	// Only whole pages that sit on one server in one piece can be merged
+	if (coalesce && nr_stripes == 1 && !nr_parity && nr_replicas <= 1 && !landing_slots &&
+	    (fetch_auto || fetch_size == BUFFER_SIZE))
+	{
+		if (huge_alloc(&batch_mem, COALESCE_MAX * BUFFER_SIZE, 0))
+			return 1;
+		batch = batch_mem.addr;
+		topo_bind_memory(batch, batch_mem.size, nic_node);
+	}
+	if (nr_replicas > 1)
+	{
+		if (huge_alloc(&hedge_mem, (size_t)nr_servers * BUFFER_SIZE, 0))
+			return 1;
+		hedge_buf = hedge_mem.addr;
+		topo_bind_memory(hedge_buf, hedge_mem.size, nic_node);
 	}
 
-#ifdef UVM
-	fd = open("/dev/nvidia-uvm", O_RDWR);
-	if (fd == -1)
+	for (i = 0; i < nr_servers; i++)
 	{
-		printf("uvm open failed\n");
-		return -1;
+		if (connect_server(ec, &servers[i]))
+			return 1;
 	}
 
-	ret = ioctl(fd, SET_BUFFER, buffer);
-	if (ret < 0)
+	// The fault loop cycles through all remote pages
+	advise_hot(0, REMOTE_PAGENUM);
+
+#ifdef UVM
+	// the stand-in producer has no GPU behind it
+	if (!emu)
 	{
-		printf("SET_BUFFER failed\n");
-		return -1;
+		fd = open("/dev/nvidia-uvm", O_RDWR);
+		if (fd == -1)
+		{
+			printf("uvm open failed\n");
+			return -1;
+		}
+
+		ret = ioctl(fd, SET_BUFFER, buffer);
+		if (ret < 0)
+		{
+			printf("SET_BUFFER failed\n");
+			return -1;
+		}
 	}
 #endif
 	// for (int i = 0; i < 1000000; i++)
 	// {
-	// 	read_page(server_addr + (next_page % REMOTE_PAGENUM) * BUFFER_SIZE);
+	// 	read_page(next_page % REMOTE_PAGENUM);
 	// 	next_page++;
 	// 	// write_page();
 	// 	// usleep(500);
 	// }
+	if (emu)
+		emu->attached = 1;
 	while (1)
 	{
 		__sync_synchronize(); // Memory barrier
-		if (queue->head != queue->tail)
-		{
-			struct fault_task *task = &queue->buffer[queue->tail];
-			// Process the task...
-			read_page(server_addr + (next_page % REMOTE_PAGENUM) * BUFFER_SIZE);
-			next_page++;
-			task->processed = 1;
-			__sync_synchronize();
+		if (queue->head != (next_task < 0 ? queue->tail : next_task))
+		{
 			// user space program does not update the queue
+			handle_faults();
 		}
-#ifdef EXIT
-		if (exit_requested)
+		else
 		{
-			goto cleanup;
+			check_servers();
+			wb_progress();
+			// the stand-in's run is over once it is drained
+			if (emu && emu->finished)
+				goto cleanup;
 		}
-#endif
+		if (handle_events())
+			goto cleanup;
 	}
 
 cleanup:
 	// Clean up
 	printf("Cleaning up...\n");
-	ibv_destroy_qp(conn->qp);
-	ibv_destroy_cq(cq);
-	ibv_dereg_mr(mr);
-	munmap(buffer, BUFFER_SIZE);
-	rdma_destroy_id(conn);
+	wb_flush();
+	for (i = 0; i < nr_servers; i++)
+	{
+		struct server *s = &servers[i];
+
+		printf("%s: %lu reads\n", s->name, s->reads);
+		if (landing_slots)
+			printf("%s: push-prefetch hits: %lu\n", s->name, s->landing_hits);
+		teardown_server(s);
+	}
+	chash_free(&ring);
+	printf("Fetched %lu bytes in %lu faults\n", fetched_bytes, nr_faults);
+	printf("Writebacks: %lu\n", writebacks);
+	if (done_ring)
+		printf("Faults completed: %lu, driver notified %lu times\n", faults_done, done_notifies);
+	if (emu && faults_done)
+		printf("Fault handoff: picked up %lu ns, handled %lu ns after enqueue on average\n",
+		       pickup_ns / faults_done, handled_ns / faults_done);
+	if (coalesced_reads)
+		printf("Merged READs: %lu, covering %lu pages, %lu ns copying each out\n", coalesced_reads,
+		       coalesced_pages, batch_copy_ns / coalesced_pages);
+	if (nr_replicas > 1)
+		printf("Hedged reads: %lu, won %lu, threshold %lu ns\n", hedges, hedge_wins, hedge_threshold);
+	if (spin_ns >= 0)
+		printf("Slept on completion channels %lu times\n", cq_sleeps);
+#ifdef PROFILE_POST
+	if (post_doorbells)
+		printf("Posting: %lu WRs in %lu doorbells, %lu ns per WR\n", post_wrs, post_doorbells,
+		       post_ns / post_wrs);
+#endif
+	if (nr_parity)
+		huge_free(&parity_mem);
+	if (batch)
+		huge_free(&batch_mem);
+	if (hedge_buf)
+		huge_free(&hedge_mem);
+	huge_free(&wb_mem);
+	huge_free(&buffer_mem);
 	rdma_destroy_event_channel(ec);
-	pthread_mutex_destroy(&send_receive_mutex);
 
 	printf("Client finished successfully.\n");
 #ifdef PROFILE
@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <string.h>
+#include "ec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EC_HAVE_SSSE3
+#endif
+
+#define GF_POLY 0x11d // x^8 + x^4 + x^3 + x^2 + 1
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static int use_ssse3;
+
+static void
+gf_init(void)
+{
+	int i, x = 1;
+
+	if (gf_exp[0])
+		return;
+	for (i = 0; i < 255; i++)
+	{
+		gf_exp[i] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF_POLY;
+	}
+	// doubled so gf_mul needs no modulo
+	for (i = 255; i < 512; i++)
+		gf_exp[i] = gf_exp[i - 255];
+#ifdef EC_HAVE_SSSE3
+	use_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+static uint8_t
+gf_mul(uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t
+gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+static void
+xor_region(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t d, s;
+
+		memcpy(&d, dst + i, 8);
+		memcpy(&s, src + i, 8);
+		d ^= s;
+		memcpy(dst + i, &d, 8);
+	}
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+#ifdef EC_HAVE_SSSE3
+// c * x for every byte x, as the xor of table lookups on its two nibbles
+__attribute__((target("ssse3"))) static void
+mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	__m128i tlo, thi, mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+	int n;
+
+	for (n = 0; n < 16; n++)
+	{
+		lo[n] = gf_mul(c, n);
+		hi[n] = gf_mul(c, n << 4);
+	}
+	tlo = _mm_loadu_si128((const __m128i *)lo);
+	thi = _mm_loadu_si128((const __m128i *)hi);
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+	}
+	for (; i < len; i++)
+		dst[i] ^= gf_mul(c, src[i]);
+}
+#endif
+
+// dst ^= c * src
+static void
+mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	size_t i;
+
+	if (!c)
+		return;
+	if (c == 1)
+	{
+		xor_region(dst, src, len);
+		return;
+	}
+#ifdef EC_HAVE_SSSE3
+	if (use_ssse3)
+	{
+		mul_add_ssse3(dst, src, c, len);
+		return;
+	}
+#endif
+	for (i = 0; i < len; i++)
+		dst[i] ^= gf_mul(c, src[i]);
+}
+
+int
+ec_init(struct ec *ec, int k, int m)
+{
+	int i, j;
+
+	if (k < 1 || m < 0 || k + m > EC_MAX_SPLITS)
+	{
+		fprintf(stderr, "ec: unsupported code %d+%d\n", k, m);
+		return -1;
+	}
+	gf_init();
+	memset(ec, 0, sizeof(*ec));
+	ec->k = k;
+	ec->m = m;
+	for (i = 0; i < k; i++)
+		ec->matrix[i][i] = 1;
+	// Cauchy rows 1 / (x_i + y_j) with x_i = k + i and y_j = j; every square
+	// submatrix of [I; C] is invertible. A single parity row of ones is
+	// MDS as well and keeps m = 1 to plain XOR.
+	for (i = 0; i < m; i++)
+	{
+		for (j = 0; j < k; j++)
+			ec->matrix[k + i][j] = m == 1 ? 1 : gf_inv((k + i) ^ j);
+	}
+	return 0;
+}
+
+// Compute the m parity splits of len bytes each from the k data splits
+void
+ec_encode(const struct ec *ec, uint8_t **data, uint8_t **parity, size_t len)
+{
+	int i, j;
+
+	for (i = 0; i < ec->m; i++)
+	{
+		memset(parity[i], 0, len);
+		for (j = 0; j < ec->k; j++)
+			mul_add(parity[i], data[j], ec->matrix[ec->k + i][j], len);
+	}
+}
+
+// Invert the n x n matrix a in place; -1 if it is singular
+static int
+invert(uint8_t a[EC_MAX_SPLITS][EC_MAX_SPLITS], uint8_t inv[EC_MAX_SPLITS][EC_MAX_SPLITS], int n)
+{
+	int row, col, r;
+
+	memset(inv, 0, EC_MAX_SPLITS * EC_MAX_SPLITS);
+	for (row = 0; row < n; row++)
+		inv[row][row] = 1;
+	for (col = 0; col < n; col++)
+	{
+		uint8_t f;
+
+		for (r = col; r < n && !a[r][col]; r++)
+			;
+		if (r == n)
+			return -1;
+		if (r != col)
+		{
+			uint8_t tmp[EC_MAX_SPLITS];
+
+			memcpy(tmp, a[r], sizeof(tmp));
+			memcpy(a[r], a[col], sizeof(tmp));
+			memcpy(a[col], tmp, sizeof(tmp));
+			memcpy(tmp, inv[r], sizeof(tmp));
+			memcpy(inv[r], inv[col], sizeof(tmp));
+			memcpy(inv[col], tmp, sizeof(tmp));
+		}
+		f = gf_inv(a[col][col]);
+		for (r = 0; r < n; r++)
+		{
+			a[col][r] = gf_mul(a[col][r], f);
+			inv[col][r] = gf_mul(inv[col][r], f);
+		}
+		for (row = 0; row < n; row++)
+		{
+			uint8_t g = a[row][col];
+
+			if (row == col || !g)
+				continue;
+			for (r = 0; r < n; r++)
+			{
+				a[row][r] ^= gf_mul(g, a[col][r]);
+				inv[row][r] ^= gf_mul(g, inv[col][r]);
+			}
+		}
+	}
+	return 0;
+}
+
+// Rebuild the missing data splits in place from any k present splits.
+// splits[i] for i < k + m points at split i; present[i] is nonzero if it
+// holds valid contents. Missing parity splits are left alone.
+int
+ec_decode(const struct ec *ec, uint8_t **splits, const int *present, size_t len)
+{
+	uint8_t a[EC_MAX_SPLITS][EC_MAX_SPLITS], inv[EC_MAX_SPLITS][EC_MAX_SPLITS];
+	int used[EC_MAX_SPLITS];
+	int i, j, n = 0, missing = 0;
+
+	for (i = 0; i < ec->k; i++)
+		missing += !present[i];
+	if (!missing)
+		return 0;
+	// data splits first: their rows are cheap identity rows
+	for (i = 0; i < ec->k + ec->m && n < ec->k; i++)
+	{
+		if (present[i])
+			used[n++] = i;
+	}
+	if (n < ec->k)
+		return -1;
+	for (i = 0; i < ec->k; i++)
+		memcpy(a[i], ec->matrix[used[i]], sizeof(a[i]));
+	if (invert(a, inv, ec->k))
+		return -1;
+
+	for (i = 0; i < ec->k; i++)
+	{
+		if (present[i])
+			continue;
+		memset(splits[i], 0, len);
+		for (j = 0; j < ec->k; j++)
+			mul_add(splits[i], splits[used[j]], inv[i][j], len);
+	}
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef EC_H
+#define EC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EC_MAX_SPLITS 16 // data + parity
+
+// Systematic Reed-Solomon code over GF(2^8): k data splits and m parity
+// splits, any k of which recover the data. Parity rows come from a Cauchy
+// matrix, or are plain XOR parity when m is 1. Region operations use SSSE3
+// nibble-table multiplication when the CPU has it.
+struct ec
+{
+	int k;
+	int m;
+	uint8_t matrix[EC_MAX_SPLITS][EC_MAX_SPLITS]; // (k + m) x k, identity on top
+};
+
+int ec_init(struct ec *ec, int k, int m);
+void ec_encode(const struct ec *ec, uint8_t **data, uint8_t **parity, size_t len);
+int ec_decode(const struct ec *ec, uint8_t **splits, const int *present, size_t len);
+
+#endif
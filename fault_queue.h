@@ -0,0 +1,65 @@
+#ifndef FAULT_QUEUE_H
+#define FAULT_QUEUE_H
+
+#include <stdint.h>
+
+// Fault queue shared with the /dev/fault_queue driver. The driver fills
+// buffer[head] and advances head; the client handles the task, sets
+// processed, and the driver advances tail once it sees it.
+#define DEVICE_NAME "/dev/fault_queue"
+#define QUEUE_SIZE 32
+
+struct fault_task
+{
+	void *fault_va;
+	int processed;
+};
+
+struct fault_queue
+{
+	struct fault_task buffer[QUEUE_SIZE];
+	volatile int head;
+	volatile int tail;
+};
+
+// Batched fault completion. Besides setting processed, the client appends
+// the queue slot of every handled fault to a ring the driver maps at
+// DONE_RING_OFFSET and wakes it with one FAULT_HANDLED_BATCH (argument:
+// entries added) per burst of faults, or not at all while the driver sets
+// polling. A driver with the ring sets magic to DONE_RING_MAGIC before it
+// hands out the mapping; without it, the mapping fails or (with a driver
+// that ignores the offset) shows something else there, and the client
+// completes through processed only.
+#define FAULT_HANDLED_BATCH 0x1234567a
+#define DONE_RING_OFFSET 4096
+#define DONE_RING_SIZE 64
+#define DONE_RING_MAGIC 0x46514431 // "FQD1", bumped if the layout changes
+
+struct fault_done_ring
+{
+	uint32_t magic;
+	uint32_t slot[DONE_RING_SIZE]; // queue slot of each handled fault
+	volatile uint32_t head;        // client: entries published
+	volatile uint32_t tail;        // driver: entries consumed
+	volatile uint32_t polling;     // driver: it polls head, needs no wakeup
+};
+
+// Userspace stand-in for the driver (queue_tester -E): a memfd laid out
+// like the device mapping, queue at 0 and done ring at DONE_RING_OFFSET,
+// followed by this page, which the driver does not have. It carries the
+// producer's enqueue times (CLOCK_MONOTONIC ns, per queue slot) so the
+// consumer can measure the handoff too, and flags for the start and the
+// end of the run.
+#define EMU_INFO_OFFSET 8192
+#define EMU_MAGIC 0x46514531 // "FQE1"
+#define EMU_SIZE (EMU_INFO_OFFSET + 4096)
+
+struct fault_queue_emu
+{
+	uint32_t magic;
+	volatile uint32_t attached; // consumer: set up, faults may come
+	volatile uint32_t finished; // producer: no more faults will come
+	volatile uint64_t enqueued_ns[QUEUE_SIZE];
+};
+
+#endif
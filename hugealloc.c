@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "hugealloc.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static size_t
+round_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+// Never MAP_NORESERVE: the pool has to be short at mmap time, not at the
+// first touch (SIGBUS), for the caller to fall back to smaller pages
+static void *
+map_hugetlb(size_t size, int page_flag)
+{
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_flag;
+
+	return mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+}
+
+// Map size bytes with the largest page size available: 1GB hugetlb pages
+// for regions of at least 1GB, then 2MB hugetlb pages, then THP. The THP
+// mapping is 2MB aligned so the kernel can back it with huge pages. On
+// success mem describes the mapping actually obtained.
+int
+huge_alloc(struct huge_mem *mem, size_t size, int flags)
+{
+	char *raw, *aligned;
+	size_t raw_size;
+
+	memset(mem, 0, sizeof(*mem));
+
+	if (!(flags & HUGE_NO_1G) && size >= HUGE_1G_SIZE)
+	{
+		mem->size = round_up(size, HUGE_1G_SIZE);
+		mem->addr = map_hugetlb(mem->size, MAP_HUGE_1GB);
+		if (mem->addr != MAP_FAILED)
+		{
+			mem->page_size = HUGE_1G_SIZE;
+			mem->kind = HUGE_KIND_1G;
+			return 0;
+		}
+	}
+
+	mem->size = round_up(size, HUGE_2M_SIZE);
+	mem->addr = map_hugetlb(mem->size, MAP_HUGE_2MB);
+	if (mem->addr != MAP_FAILED)
+	{
+		mem->page_size = HUGE_2M_SIZE;
+		mem->kind = HUGE_KIND_2M;
+		return 0;
+	}
+
+	// Over-allocate by one huge page and trim to a 2MB boundary
+	raw_size = mem->size + HUGE_2M_SIZE;
+	raw = mmap(NULL, raw_size, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | (flags & HUGE_NORESERVE ? MAP_NORESERVE : 0), -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		perror("mmap");
+		mem->addr = NULL;
+		return -1;
+	}
+	aligned = (char *)round_up((uintptr_t)raw, HUGE_2M_SIZE);
+	if (aligned > raw)
+		munmap(raw, aligned - raw);
+	if (raw + raw_size > aligned + mem->size)
+		munmap(aligned + mem->size, raw + raw_size - (aligned + mem->size));
+	if (madvise(aligned, mem->size, MADV_HUGEPAGE))
+		perror("madvise(MADV_HUGEPAGE)");
+
+	mem->addr = aligned;
+	mem->page_size = HUGE_2M_SIZE;
+	mem->kind = HUGE_KIND_THP;
+	return 0;
+}
+
+// Map [addr, addr + size) of a reservation with pages of the given kind.
+// On failure the range is reserved again, as the failed mmap may have
+// dropped it.
+static int
+map_fixed(char *addr, size_t size, enum huge_kind kind, int flags)
+{
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+	int err;
+
+	if (kind == HUGE_KIND_1G)
+		map_flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+	else if (kind == HUGE_KIND_2M)
+		map_flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+	if (kind == HUGE_KIND_THP && (flags & HUGE_NORESERVE))
+		map_flags |= MAP_NORESERVE;
+	if (mmap(addr, size, PROT_READ | PROT_WRITE, map_flags, -1, 0) == MAP_FAILED)
+	{
+		err = errno;
+		mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		errno = err;
+		return -1;
+	}
+	if (kind == HUGE_KIND_THP && madvise(addr, size, MADV_HUGEPAGE))
+		perror("madvise(MADV_HUGEPAGE)");
+	return 0;
+}
+
+// Like huge_alloc(), but keep the address space up to max_size free behind
+// the mapping, so that huge_grow() can extend it in place with pages of the
+// same size. Registered memory cannot move, so this is the only way to
+// grow it.
+int
+huge_alloc_growable(struct huge_mem *mem, size_t size, size_t max_size, int flags)
+{
+	int use_1g = !(flags & HUGE_NO_1G) && size >= HUGE_1G_SIZE;
+	size_t align = use_1g ? HUGE_1G_SIZE : HUGE_2M_SIZE;
+	size_t raw_size;
+	char *raw, *aligned;
+
+	if (max_size <= size)
+		return huge_alloc(mem, size, flags);
+	memset(mem, 0, sizeof(*mem));
+
+	// PROT_NONE and unbacked until huge_grow() maps it
+	mem->reserved = round_up(max_size, align);
+	raw_size = mem->reserved + align;
+	raw = mmap(NULL, raw_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		perror("mmap");
+		mem->reserved = 0;
+		return -1;
+	}
+	aligned = (char *)round_up((uintptr_t)raw, align);
+	if (aligned > raw)
+		munmap(raw, aligned - raw);
+	if (raw + raw_size > aligned + mem->reserved)
+		munmap(aligned + mem->reserved, raw + raw_size - (aligned + mem->reserved));
+	mem->addr = aligned;
+
+	if (use_1g)
+	{
+		mem->size = round_up(size, HUGE_1G_SIZE);
+		if (mem->size <= mem->reserved && !map_fixed(aligned, mem->size, HUGE_KIND_1G, flags))
+		{
+			mem->page_size = HUGE_1G_SIZE;
+			mem->kind = HUGE_KIND_1G;
+			return 0;
+		}
+	}
+	mem->size = round_up(size, HUGE_2M_SIZE);
+	mem->page_size = HUGE_2M_SIZE;
+	mem->kind = HUGE_KIND_2M;
+	if (!map_fixed(aligned, mem->size, HUGE_KIND_2M, flags))
+		return 0;
+	mem->kind = HUGE_KIND_THP;
+	if (!map_fixed(aligned, mem->size, HUGE_KIND_THP, flags))
+		return 0;
+	perror("mmap");
+	huge_free(mem);
+	return -1;
+}
+
+// Extend a huge_alloc_growable() mapping in place to size bytes
+int
+huge_grow(struct huge_mem *mem, size_t size, int flags)
+{
+	size = round_up(size, mem->page_size);
+	if (size <= mem->size)
+		return 0;
+	if (size > mem->reserved)
+	{
+		fprintf(stderr, "huge_grow: %zu bytes exceed the %zu reserved\n", size, mem->reserved);
+		return -1;
+	}
+	if (map_fixed((char *)mem->addr + mem->size, size - mem->size, mem->kind, flags))
+	{
+		perror("mmap");
+		return -1;
+	}
+	mem->size = size;
+	return 0;
+}
+
+void
+huge_free(struct huge_mem *mem)
+{
+	if (mem->addr)
+		munmap(mem->addr, mem->reserved ? mem->reserved : mem->size);
+	mem->addr = NULL;
+}
+
+const char *
+huge_kind_str(enum huge_kind kind)
+{
+	switch (kind)
+	{
+	case HUGE_KIND_1G:
+		return "1GB hugetlb";
+	case HUGE_KIND_2M:
+		return "2MB hugetlb";
+	case HUGE_KIND_THP:
+		return "THP";
+	}
+	return "unknown";
+}
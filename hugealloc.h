@@ -0,0 +1,35 @@
+#ifndef HUGEALLOC_H
+#define HUGEALLOC_H
+
+#include <stddef.h>
+
+#define HUGE_1G_SIZE (1UL << 30)
+#define HUGE_2M_SIZE (2UL << 20)
+
+// flags for huge_alloc()
+#define HUGE_NORESERVE 0x1 // THP fallback commits no memory up front (ODP)
+#define HUGE_NO_1G 0x2     // skip the 1GB attempt
+
+enum huge_kind
+{
+	HUGE_KIND_1G,  // hugetlb, 1GB pages
+	HUGE_KIND_2M,  // hugetlb, 2MB pages
+	HUGE_KIND_THP, // anonymous memory with MADV_HUGEPAGE
+};
+
+struct huge_mem
+{
+	void *addr;
+	size_t size;      // mapped size, rounded up to page_size
+	size_t page_size; // 2MB for THP (best effort)
+	enum huge_kind kind;
+	size_t reserved; // address space held for huge_grow(), 0 if none
+};
+
+int huge_alloc(struct huge_mem *mem, size_t size, int flags);
+int huge_alloc_growable(struct huge_mem *mem, size_t size, size_t max_size, int flags);
+int huge_grow(struct huge_mem *mem, size_t size, int flags);
+void huge_free(struct huge_mem *mem);
+const char *huge_kind_str(enum huge_kind kind);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Pre-handshake CM private data, still accepted from old peers. It was sent
+// with natural alignment (24 bytes); the packed variant of the early clients
+// has remote_addr and rkey at the same offsets but no mem_size.
+struct mr_info
+{
+	uintptr_t remote_addr;
+	uint32_t rkey;
+	size_t mem_size; // used for client request allocation
+};
+
+// Connection handshake, the CM private data of the connect request and of
+// the accept. It must fit the 56 bytes a connect request carries; anything
+// bigger (the chunk table) follows as control messages once connected.
+// magic tells it from an mr_info, whose remote_addr is page aligned.
+#define HELLO_MAGIC 0x524d4831 // "RMH1"
+#define HELLO_VERSION 1
+
+// Optional features. The client offers what it can use, the accept carries
+// the subset both sides use.
+#define FEAT_CTRL 0x1    // control messages: chunk table, region info, hints
+#define FEAT_NOTIFY 0x2  // IMM notifications of page writes and accesses
+#define FEAT_LANDING 0x4 // push-prefetch into a landing ring
+#define FEAT_TIERING 0x8 // pages may have to be promoted before reading
+#define FEAT_BULK_QP 0x10 // second, low-priority connection for writeback and pushes
+
+// Traffic class of a connection. A client opens its demand connection
+// first; a bulk connection joins the server's current session.
+#define QP_CLASS_DEMAND 0
+#define QP_CLASS_BULK 1
+
+struct hello_msg
+{
+	uint32_t magic;
+	uint16_t version;    // highest the sender speaks; the accept's is the one used
+	uint16_t len;        // sizeof(struct hello_msg) of the sender
+	uint64_t addr;       // region base (client: the buffer servers write to)
+	uint32_t rkey;       // of the first chunk
+	uint64_t mem_size;   // client: remote bytes needed; server: region size
+	uint64_t page_sizes; // bit n set: pages of 2^n bytes; one bit in the accept
+	uint16_t max_rd;     // client: reads it may keep outstanding; accept: the limit
+	uint16_t qp_class;   // QP_CLASS_*
+	uint32_t features;   // FEAT_*
+} __attribute__((packed));
+
+// Immediate data of RDMA_WRITE_WITH_IMM requests: an op in the top 8 bits and
+// a page index in the low 24. Sent in network byte order.
+#define IMM_OP_SHIFT 24
+#define IMM_PAGE_MASK 0xffffff
+#define IMM_ENCODE(op, page) (((uint32_t)(op) << IMM_OP_SHIFT) | ((page) & IMM_PAGE_MASK))
+#define IMM_OP(imm) ((imm) >> IMM_OP_SHIFT)
+#define IMM_PAGE(imm) ((imm) & IMM_PAGE_MASK)
+
+enum imm_op
+{
+	IMM_OP_REQUEST = 0,    // plain request, payload is not page data
+	IMM_OP_PAGE_WRITE = 1, // client wrote a full page to the page named
+	IMM_OP_ACCESS = 2,     // client faulted on the page named (no payload)
+	IMM_OP_CREDIT = 3,     // client freed "page" landing slots (no payload)
+	IMM_OP_PUSH = 4,       // server wrote the page named into the next landing slot
+};
+
+// Two-sided control messages, sent with IBV_WR_SEND after the connection is
+// established. Each receive slot holds one message.
+#define CTRL_MSG_SIZE 4096
+#define CTRL_RECV_SLOTS 8
+
+enum ctrl_type
+{
+	CTRL_MR_TABLE = 1, // server -> client: chunk-to-rkey table entries
+	CTRL_HOT_PAGES,    // client -> server: pages worth faulting in ahead of use
+	CTRL_REGION_INFO,  // server -> client: state of the region after (re)start
+	CTRL_PROMOTE,      // client -> server: bring a demoted page back into DRAM
+	CTRL_PROMOTED,     // server -> client: page is resident again
+	CTRL_LANDING,      // client -> server: ring of slots for pushed pages
+};
+
+#define PAGE_NONE 0xffffffffu
+
+struct ctrl_hdr
+{
+	uint32_t type;
+	uint32_t len; // total message length including this header
+} __attribute__((packed));
+
+// One registered chunk of the server region
+struct mr_chunk_entry
+{
+	uint64_t addr;
+	uint64_t len;
+	uint32_t rkey;
+	uint32_t flags; // unused, zero
+} __attribute__((packed));
+
+// Entries [first, first + count) of a table with nr_chunks chunks in total.
+// Chunks cover the region back to back; all but the last are chunk_size long.
+// A large table is split over several messages, and entries for chunks that
+// finish registering later (or are appended when the region grows) arrive in
+// further messages at any time.
+struct mr_table_msg
+{
+	struct ctrl_hdr hdr;
+	uint64_t base;
+	uint64_t chunk_size;
+	uint32_t nr_chunks;
+	uint32_t first;
+	uint32_t count;
+	struct mr_chunk_entry entries[];
+} __attribute__((packed));
+
+// Range of remote pages the client expects to touch soon
+struct hot_pages_msg
+{
+	struct ctrl_hdr hdr;
+	uint32_t first;
+	uint32_t count;
+} __attribute__((packed));
+
+#define REGION_PERSISTENT 0x1 // region is file backed and survives restarts
+#define REGION_WARM 0x2       // existing pages were kept from a previous run
+#define REGION_TIERED 0x4     // only nr_slots pages are in DRAM at a time
+#define REGION_SLOTS_MOVED 0x8 // tiered pages no longer start in their own slot
+
+// With REGION_TIERED, page p is read from DRAM slot s at base + s * page
+// size rather than from base + p * page size. Pages [0, nr_slots) start in
+// the slot of the same index; every other page starts demoted and has to be
+// promoted with CTRL_PROMOTE before its first access. With REGION_SLOTS_MOVED
+// (a later connection to the same region) the client knows no slots and
+// promotes every page before its first access; promoting a page that is
+// already resident just reports its slot.
+struct region_info_msg
+{
+	struct ctrl_hdr hdr;
+	uint32_t flags;
+	uint64_t nr_pages;
+	uint64_t nr_valid; // pages holding data written before this connection
+	uint32_t nr_slots;
+} __attribute__((packed));
+
+struct promote_msg
+{
+	struct ctrl_hdr hdr;
+	uint32_t page;
+} __attribute__((packed));
+
+// slot is PAGE_NONE if the promotion failed. victim, if not PAGE_NONE, was
+// demoted to make room and must not be read from its old slot any more.
+struct promoted_msg
+{
+	struct ctrl_hdr hdr;
+	uint32_t page;
+	uint32_t slot;
+	uint32_t victim;
+} __attribute__((packed));
+
+// Push-prefetch landing ring on the client. The server writes predicted
+// pages into slot (n % nr_slots) for its n-th push, with IMM_OP_PUSH naming
+// the page, and may have at most nr_slots pushes the client has not freed
+// yet. The client frees slots in ring order and returns them with
+// IMM_OP_CREDIT.
+#define LANDING_MAX_SLOTS 16
+
+struct landing_msg
+{
+	struct ctrl_hdr hdr;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t nr_slots;
+	uint64_t slot_size;
+} __attribute__((packed));
+
+#define MR_TABLE_MSG_MAX ((CTRL_MSG_SIZE - sizeof(struct mr_table_msg)) / sizeof(struct mr_chunk_entry))
+
+#endif
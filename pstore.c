@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include "pstore.h"
+
+static int
+meta_matches(struct pstore *ps)
+{
+	return ps->meta->magic == PSTORE_MAGIC && ps->meta->version == PSTORE_VERSION &&
+	       ps->meta->page_size == ps->page_size && ps->meta->nr_pages == ps->nr_pages;
+}
+
+// Map <path> as the remote region and <path>.meta as its page-state table.
+// Both are reused when their geometry matches size/page_size (a warm
+// restart); otherwise the data file is truncated to zeroes and every page
+// starts out PAGE_EMPTY. Unless odp, path must be on tmpfs or hugetlbfs.
+int
+pstore_open(struct pstore *ps, const char *path, size_t size, size_t page_size, int odp)
+{
+	char meta_path[4096];
+	struct statfs sfs;
+	struct stat st;
+	int data_ok;
+	size_t i;
+
+	memset(ps, 0, sizeof(*ps));
+	ps->size = size;
+	ps->page_size = page_size;
+	ps->nr_pages = size / page_size;
+	ps->meta_size = sizeof(struct pstore_meta) + ps->nr_pages;
+	snprintf(meta_path, sizeof(meta_path), "%s.meta", path);
+
+	ps->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (ps->fd < 0)
+	{
+		perror("open");
+		return -1;
+	}
+	ps->meta_fd = open(meta_path, O_RDWR | O_CREAT, 0600);
+	if (ps->meta_fd < 0)
+	{
+		perror("open");
+		close(ps->fd);
+		return -1;
+	}
+
+	if (fstatfs(ps->fd, &sfs))
+	{
+		perror("fstatfs");
+		goto err;
+	}
+	ps->in_memory = sfs.f_type == TMPFS_MAGIC || sfs.f_type == HUGETLBFS_MAGIC;
+	if (!ps->in_memory && !odp)
+	{
+		fprintf(stderr, "%s is neither on tmpfs nor on hugetlbfs; a file elsewhere "
+		                "cannot be pinned and needs -o (ODP)\n", path);
+		goto err;
+	}
+	if (fstat(ps->fd, &st))
+	{
+		perror("fstat");
+		goto err;
+	}
+	data_ok = (size_t)st.st_size == size;
+
+	if (ftruncate(ps->meta_fd, ps->meta_size))
+	{
+		perror("ftruncate");
+		goto err;
+	}
+	ps->meta = mmap(NULL, ps->meta_size, PROT_READ | PROT_WRITE, MAP_SHARED, ps->meta_fd, 0);
+	if (ps->meta == MAP_FAILED)
+	{
+		perror("mmap");
+		ps->meta = NULL;
+		goto err;
+	}
+
+	ps->warm = data_ok && meta_matches(ps);
+	if (!ps->warm)
+	{
+		// drop stale contents, then size the file
+		if (ftruncate(ps->fd, 0) || ftruncate(ps->fd, size))
+		{
+			perror("ftruncate");
+			goto err;
+		}
+		memset(ps->meta, 0, ps->meta_size);
+		ps->meta->magic = PSTORE_MAGIC;
+		ps->meta->version = PSTORE_VERSION;
+		ps->meta->page_size = page_size;
+		ps->meta->nr_pages = ps->nr_pages;
+	}
+	ps->meta->generation++;
+
+	ps->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ps->fd, 0);
+	if (ps->data == MAP_FAILED)
+	{
+		perror("mmap");
+		ps->data = NULL;
+		goto err;
+	}
+
+	for (i = 0; i < ps->nr_pages; i++)
+		ps->nr_valid += ps->meta->state[i] == PAGE_VALID;
+	msync(ps->meta, ps->meta_size, MS_SYNC);
+	return 0;
+
+err:
+	if (ps->meta)
+		munmap(ps->meta, ps->meta_size);
+	close(ps->meta_fd);
+	close(ps->fd);
+	return -1;
+}
+
+// Record that a client finished writing page. On disk, the page is written
+// out before its state byte, and that before returning, so a crash never
+// leaves a page marked valid without its data.
+void
+pstore_mark_valid(struct pstore *ps, size_t page)
+{
+	uintptr_t meta_page, state;
+	long pgsz = sysconf(_SC_PAGESIZE);
+
+	if (page >= ps->nr_pages)
+		return;
+	if (!ps->in_memory && msync(ps->data + page * ps->page_size, ps->page_size, MS_SYNC))
+	{
+		perror("msync");
+		return;
+	}
+	if (ps->meta->state[page] == PAGE_VALID)
+		return;
+	ps->meta->state[page] = PAGE_VALID;
+	ps->nr_valid++;
+	if (ps->in_memory)
+		return;
+	state = (uintptr_t)&ps->meta->state[page];
+	meta_page = state & ~(uintptr_t)(pgsz - 1);
+	if (msync((void *)meta_page, state - meta_page + 1, MS_SYNC))
+		perror("msync");
+}
+
+void
+pstore_close(struct pstore *ps)
+{
+	if (ps->data)
+	{
+		msync(ps->data, ps->size, MS_SYNC);
+		munmap(ps->data, ps->size);
+	}
+	if (ps->meta)
+	{
+		msync(ps->meta, ps->meta_size, MS_SYNC);
+		munmap(ps->meta, ps->meta_size);
+	}
+	close(ps->meta_fd);
+	close(ps->fd);
+}
@@ -0,0 +1,51 @@
+#ifndef PSTORE_H
+#define PSTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PSTORE_MAGIC 0x5250414745535431ULL // "RPAGEST1"
+#define PSTORE_VERSION 1
+
+enum page_state
+{
+	PAGE_EMPTY = 0, // never written by a client, reads as zero
+	PAGE_VALID = 1, // holds client data that survives a server restart
+};
+
+// Layout of the <path>.meta file next to the data file
+struct pstore_meta
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint64_t nr_pages;
+	uint64_t generation; // bumped on every open
+	uint8_t state[];     // enum page_state, one per page
+};
+
+// Remote memory backed by a MAP_SHARED file. A tmpfs or hugetlbfs file can
+// be pinned and survives server restarts but not a reboot. A file on any
+// other filesystem needs an ODP registration, since the kernel refuses to
+// long-term pin writable shared file mappings; it also survives a reboot,
+// as each page is on disk before it is marked valid.
+struct pstore
+{
+	int fd;
+	int meta_fd;
+	char *data;
+	size_t size;
+	size_t page_size;
+	size_t nr_pages;
+	struct pstore_meta *meta;
+	size_t meta_size;
+	int in_memory;   // tmpfs or hugetlbfs: nothing to flush
+	int warm;        // existing data and metadata were reused
+	size_t nr_valid; // PAGE_VALID pages found when opening
+};
+
+int pstore_open(struct pstore *ps, const char *path, size_t size, size_t page_size, int odp);
+void pstore_mark_valid(struct pstore *ps, size_t page);
+void pstore_close(struct pstore *ps);
+
+#endif
@@ -1,8 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include "fault_queue.h"
+#include "workload.h"
 
 // #define UVM
 
@@ -15,26 +25,429 @@
 char *buffer;
 #endif
 
-#define DEVICE_NAME "/dev/fault_queue"
-#define QUEUE_SIZE 32
+// -e: a stand-in for the driver (producer thread) and the client
+// (consumer, main thread) sharing one mapping, to exercise completion
+// batching without the kernel module. The consumer publishes every fault
+// in the done ring at once and notifies the producer through an eventfd,
+// the stand-in for FAULT_HANDLED_BATCH, every -b faults or when the queue
+// runs empty; with -P the producer polls the ring and is never notified.
+struct fault_queue *queue;
+struct fault_done_ring *done_ring;
+int notify_fd;
+long nr_faults = 1000000; // -n
+int batch = QUEUE_SIZE;   // -b
+volatile int produced_all;
+uint64_t enqueued_at[QUEUE_SIZE];
+uint64_t total_latency, notifies, wakeups;
 
-struct fault_task
+uint64_t
+now_ns()
 {
-	void *fault_va;
-	int processed;
-};
+	struct timespec ts;
 
-struct fault_queue
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Retire what the consumer completed, in queue order as a driver would.
+// Blocks for a notification if wait is set and nothing is there yet.
+long
+reap(int wait)
+{
+	uint64_t count;
+	long n = 0;
+
+	if (wait && !done_ring->polling && done_ring->tail == done_ring->head)
+	{
+		if (read(notify_fd, &count, sizeof(count)) == sizeof(count))
+			wakeups++;
+	}
+	while (done_ring->tail != done_ring->head)
+	{
+		uint32_t slot;
+
+		__sync_synchronize();
+		slot = done_ring->slot[done_ring->tail % DONE_RING_SIZE];
+		total_latency += now_ns() - enqueued_at[slot];
+		done_ring->tail++;
+		queue->tail = (slot + 1) % QUEUE_SIZE;
+		n++;
+	}
+	return n;
+}
+
+void *
+producer(void *arg)
+{
+	long sent = 0, retired = 0;
+	int head;
+
+	(void)arg;
+	while (retired < nr_faults)
+	{
+		head = queue->head;
+		if (sent < nr_faults && (head + 1) % QUEUE_SIZE != queue->tail)
+		{
+			queue->buffer[head].fault_va = (void *)(uintptr_t)(sent * 4096);
+			queue->buffer[head].processed = 0;
+			enqueued_at[head] = now_ns();
+			__sync_synchronize();
+			queue->head = (head + 1) % QUEUE_SIZE;
+			sent++;
+			retired += reap(0);
+		}
+		else
+		{
+			// queue full or everything sent: wait for completions
+			retired += reap(1);
+		}
+	}
+	produced_all = 1;
+	return NULL;
+}
+
+void
+notify_producer(int n)
+{
+	uint64_t count = n;
+
+	if (done_ring->polling || !n)
+		return;
+	if (write(notify_fd, &count, sizeof(count)) != sizeof(count))
+		perror("write");
+	notifies++;
+}
+
+// -E: the stand-in driver as a process of its own, driving a consumer in
+// another process (client -q) with a synthetic fault workload. It creates
+// the memfd, waits for the consumer to attach, then raises -n faults on
+// pages picked by the -p pattern (see workload.h) and retires each once
+// processed is set, like the driver.
+//
+// With -R the run is open loop: bursts of -B faults arrive at a mean of
+// -R faults/s whether or not the consumer keeps up, and the response time
+// of a fault counts from its arrival, including the time it waited for a
+// free queue slot. Without -R each burst is raised once the one before is
+// handled (with -B), or faults keep the queue full. The service time
+// counts from the enqueue. Both are reported as percentiles and, with -o,
+// written out as CDFs; the consumer measures its pickup and handling from
+// the enqueue stamps.
+#define FAULT_VA_BASE 0x7f0000000000ULL
+#define PAGE_2M (2 * 1024 * 1024)
+#define NR_PAGES 10     // -N default: remote pages of the client
+#define CDF_POINTS 1000 // per latency in the -o file
+long rate;                   // -R
+long burst;                  // -B
+const char *pattern = "seq"; // -p
+uint64_t nr_pages = NR_PAGES; // -N
+uint64_t seed = 1;            // -s
+const char *cdf_path;         // -o
+struct fault_queue_emu *emu;
+
+static int
+u64_cmp(const void *a, const void *b)
 {
-	struct fault_task buffer[QUEUE_SIZE];
-	volatile int head;
-	volatile int tail;
-};
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Print percentiles of the n latencies in lat (sorted here), and their
+// CDF to cdf if given
+void
+report_latency(const char *name, uint64_t *lat, long n, FILE *cdf)
+{
+	static const double pct[] = {50, 90, 99, 99.9, 99.99};
+	uint64_t sum = 0;
+	long i, step;
+
+	qsort(lat, n, sizeof(*lat), u64_cmp);
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+	printf("%-8s mean %8lu", name, sum / n);
+	for (i = 0; i < (long)(sizeof(pct) / sizeof(pct[0])); i++)
+		printf("  p%g %8lu", pct[i], lat[(long)(pct[i] / 100 * (n - 1))]);
+	printf("  max %8lu ns\n", lat[n - 1]);
+	if (!cdf)
+		return;
+	step = n > CDF_POINTS ? n / CDF_POINTS : 1;
+	for (i = step - 1; i < n; i += step)
+		fprintf(cdf, "%s %lu %.6f\n", name, lat[i], (double)(i + 1) / n);
+	if ((n - 1) % step != step - 1)
+		fprintf(cdf, "%s %lu %.6f\n", name, lat[n - 1], 1.0);
+}
+
+// Open-loop arrival of fault i: bursts of -B faults, -R faults/s on average
+uint64_t
+arrival_time(uint64_t start, long i)
+{
+	long b = burst ? burst : 1;
+
+	return start + (uint64_t)(i / b) * b * 1000000000ULL / rate;
+}
 
 int
-main()
+produce()
 {
-	int fd;
+	struct workload wl;
+	uint64_t start, elapsed, now, arrival_ns[QUEUE_SIZE];
+	uint64_t *response, *service;
+	long sent = 0, retired = 0, slot_fault[QUEUE_SIZE];
+	int memfd, head, tail, ready;
+	FILE *cdf = NULL;
+	char *mem;
+
+	if (wl_init(&wl, pattern, nr_pages, seed))
+	{
+		fprintf(stderr, "Bad pattern %s for %lu pages\n", pattern, nr_pages);
+		return 1;
+	}
+	response = malloc(nr_faults * sizeof(*response));
+	service = malloc(nr_faults * sizeof(*service));
+	if (!response || !service)
+	{
+		perror("malloc");
+		return 1;
+	}
+	if (cdf_path && !(cdf = fopen(cdf_path, "w")))
+	{
+		perror(cdf_path);
+		return 1;
+	}
+	memfd = memfd_create("fault_queue", 0);
+	if (memfd < 0 || ftruncate(memfd, EMU_SIZE))
+	{
+		perror("memfd_create");
+		return 1;
+	}
+	mem = mmap(NULL, EMU_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (mem == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	queue = (struct fault_queue *)mem;
+	done_ring = (struct fault_done_ring *)(mem + DONE_RING_OFFSET);
+	emu = (struct fault_queue_emu *)(mem + EMU_INFO_OFFSET);
+	done_ring->magic = DONE_RING_MAGIC;
+	done_ring->polling = 1; // we watch processed, like the driver
+	emu->magic = EMU_MAGIC;
+	printf("Fault queue stand-in ready, run the consumer with -q /proc/%d/fd/%d\n", getpid(), memfd);
+	fflush(stdout);
+	while (!emu->attached)
+		usleep(1000);
+	printf("Consumer attached, injecting %ld faults: %s over %lu pages", nr_faults, pattern, nr_pages);
+	if (rate)
+		printf(", %ld/s in bursts of %ld", rate, burst ? burst : 1);
+	else if (burst)
+		printf(", closed loop in bursts of %ld", burst);
+	printf("\n");
+
+	start = now_ns();
+	while (retired < nr_faults)
+	{
+		// retire in order, as the consumer sets processed
+		__sync_synchronize();
+		tail = queue->tail;
+		if (tail != queue->head && queue->buffer[tail].processed)
+		{
+			now = now_ns();
+			response[slot_fault[tail]] = now - arrival_ns[tail];
+			service[slot_fault[tail]] = now - emu->enqueued_ns[tail];
+			// drain the ring; the stand-in polls, so it is never notified
+			done_ring->tail = done_ring->head;
+			queue->tail = (tail + 1) % QUEUE_SIZE;
+			retired++;
+			continue;
+		}
+
+		// has fault "sent" arrived?
+		head = queue->head;
+		now = now_ns();
+		if (sent == nr_faults || (head + 1) % QUEUE_SIZE == queue->tail)
+			ready = 0;
+		else if (wl.dependent && sent > retired)
+			ready = 0;
+		else if (rate)
+			ready = now >= arrival_time(start, sent);
+		else
+			ready = !burst || sent % burst || sent == retired;
+		if (!ready)
+		{
+			// nothing to do; leave the CPU to the consumer if it shares it
+			sched_yield();
+			continue;
+		}
+
+		queue->buffer[head].fault_va = (void *)(uintptr_t)(FAULT_VA_BASE + wl_next(&wl) * PAGE_2M +
+		                                                   wl_rand(&wl) % (PAGE_2M / 4096) * 4096);
+		queue->buffer[head].processed = 0;
+		slot_fault[head] = sent;
+		arrival_ns[head] = rate ? arrival_time(start, sent) : now;
+		emu->enqueued_ns[head] = now_ns();
+		__sync_synchronize();
+		queue->head = (head + 1) % QUEUE_SIZE;
+		sent++;
+	}
+	elapsed = now_ns() - start;
+	emu->finished = 1;
+
+	printf("%ld faults in %.3f s: %.0f faults/s", nr_faults, elapsed / 1e9, nr_faults * 1e9 / elapsed);
+	if (rate)
+		printf(" (offered %ld/s)", rate);
+	printf("\n");
+	report_latency("response", response, nr_faults, cdf);
+	report_latency("service", service, nr_faults, cdf);
+	if (cdf)
+		fclose(cdf);
+	wl_free(&wl);
+	free(response);
+	free(service);
+	return 0;
+}
+
+int
+emulate(int polling)
+{
+	pthread_t tid;
+	uint64_t start, elapsed;
+	uint32_t done_head;
+	int next = 0, pending = 0;
+
+	queue = mmap(NULL, sizeof(struct fault_queue), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	done_ring = mmap(NULL, sizeof(struct fault_done_ring), PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (queue == MAP_FAILED || done_ring == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	done_ring->magic = DONE_RING_MAGIC;
+	done_ring->polling = polling;
+	notify_fd = eventfd(0, 0);
+	if (notify_fd < 0)
+	{
+		perror("eventfd");
+		return 1;
+	}
+
+	start = now_ns();
+	if (pthread_create(&tid, NULL, producer, NULL))
+	{
+		perror("pthread_create");
+		return 1;
+	}
+	while (!produced_all)
+	{
+		__sync_synchronize();
+		if (queue->head == next)
+		{
+			// drained: whatever is still unannounced goes now
+			notify_producer(pending);
+			pending = 0;
+			continue;
+		}
+		queue->buffer[next].processed = 1;
+		done_head = done_ring->head;
+		done_ring->slot[done_head % DONE_RING_SIZE] = next;
+		__sync_synchronize();
+		done_ring->head = done_head + 1;
+		next = (next + 1) % QUEUE_SIZE;
+		if (++pending == batch)
+		{
+			notify_producer(pending);
+			pending = 0;
+		}
+	}
+	pthread_join(tid, NULL);
+	elapsed = now_ns() - start;
+
+	printf("%ld faults in %.3f s: %.0f faults/s\n", nr_faults, elapsed / 1e9, nr_faults * 1e9 / elapsed);
+	printf("Notifications: %lu (%.2f faults each), producer wakeups: %lu\n", notifies,
+	       notifies ? (double)nr_faults / notifies : 0.0, wakeups);
+	printf("Mean enqueue-to-retire latency: %lu ns\n", total_latency / nr_faults);
+	return 0;
+}
+
+void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-e [-b batch] [-P] | -E [-p pattern] [-N pages] [-R rate] [-B burst]\n"
+	                "       [-s seed] [-o cdf_file]] [-n faults]\n", prog);
+	fprintf(stderr, "  -e         emulate driver and client in-process, no kernel module\n");
+	fprintf(stderr, "  -b batch   faults per completion notification, at most (default %d)\n", QUEUE_SIZE);
+	fprintf(stderr, "  -P         the producer polls the done ring, no notifications\n");
+	fprintf(stderr, "  -E         stand in for the driver; a consumer in another process\n");
+	fprintf(stderr, "             (client -q) serves the queue\n");
+	fprintf(stderr, "  -p pattern pages faulted on (default seq): seq, stride:n, random,\n");
+	fprintf(stderr, "             zipf[:s], chase, phase[:pages[,faults]]\n");
+	fprintf(stderr, "  -N pages   pages the pattern ranges over (default %d)\n", NR_PAGES);
+	fprintf(stderr, "  -R rate    open loop: faults arriving per second (default: closed\n");
+	fprintf(stderr, "             loop, as fast as the consumer handles them)\n");
+	fprintf(stderr, "  -B burst   faults arriving together (closed loop: raised once the\n");
+	fprintf(stderr, "             burst before is handled)\n");
+	fprintf(stderr, "  -s seed    of the pattern's random choices (default 1)\n");
+	fprintf(stderr, "  -o file    write response and service time CDFs to file\n");
+	fprintf(stderr, "  -n faults  faults to run through with -e or -E (default %ld)\n", nr_faults);
+}
+
+int
+main(int argc, char **argv)
+{
+	int fd, opt, emulated = 0, polling = 0, standin = 0;
+
+	while ((opt = getopt(argc, argv, "en:b:PER:p:N:B:s:o:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'e':
+			emulated = 1;
+			break;
+		case 'E':
+			standin = 1;
+			break;
+		case 'R':
+			rate = atol(optarg);
+			break;
+		case 'p':
+			pattern = optarg;
+			break;
+		case 'N':
+			nr_pages = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			burst = atol(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			cdf_path = optarg;
+			break;
+		case 'n':
+			nr_faults = atol(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'P':
+			polling = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (nr_faults < 1 || batch < 1 || rate < 0 || burst < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (emulated)
+		return emulate(polling);
+	if (standin)
+		return produce();
+
 #ifdef UVM
 	int ret;
 	buffer = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
@@ -65,8 +478,7 @@ main()
 
 	printf("open success\n");
 
-	struct fault_queue *queue = mmap(NULL, sizeof(struct fault_queue),
-	                                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	queue = mmap(NULL, sizeof(struct fault_queue), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (queue == MAP_FAILED)
 	{
 		perror("mmap");
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "regmem.h"
+
+static size_t
+chunk_len(struct regmem *rm, int idx)
+{
+	size_t off = (size_t)idx * rm->chunk_size;
+
+	return rm->size - off < rm->chunk_size ? rm->size - off : rm->chunk_size;
+}
+
+static void *
+regmem_worker(void *arg)
+{
+	struct regmem *rm = (struct regmem *)arg;
+	struct ibv_mr *mr;
+	int idx;
+
+	while ((idx = atomic_fetch_add(&rm->next_chunk, 1)) < rm->nr_chunks)
+	{
+		mr = ibv_reg_mr(rm->pd, rm->base + (size_t)idx * rm->chunk_size,
+		                chunk_len(rm, idx), rm->access);
+		if (!mr)
+		{
+			perror("ibv_reg_mr");
+			atomic_store(&rm->failed, 1);
+			continue;
+		}
+		atomic_store(&rm->mrs[idx], mr);
+		atomic_fetch_add(&rm->nr_ready, 1);
+	}
+	return NULL;
+}
+
+static void
+regmem_spawn(struct regmem *rm, int nr_threads)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int pending = rm->nr_chunks - atomic_load(&rm->next_chunk);
+	int i;
+
+	if (nr_threads <= 0)
+		nr_threads = ncpu > 0 ? ncpu : 1;
+	if (nr_threads > REGMEM_MAX_THREADS)
+		nr_threads = REGMEM_MAX_THREADS;
+	if (nr_threads > pending)
+		nr_threads = pending;
+
+	rm->nr_threads = 0;
+	for (i = 0; i < nr_threads; i++)
+	{
+		if (pthread_create(&rm->threads[i], NULL, regmem_worker, rm))
+			break;
+		rm->nr_threads++;
+	}
+	if (rm->nr_threads == 0)
+		regmem_worker(rm);
+}
+
+// Queue registration of [base, base + size) and return without waiting.
+// chunk_size is doubled until the region fits in REGMEM_MAX_CHUNKS MRs, so
+// it stays a multiple of the caller's page size.
+int
+regmem_start(struct regmem *rm, struct ibv_pd *pd, void *base, size_t size,
+             size_t chunk_size, int access, int nr_threads)
+{
+	memset(rm, 0, sizeof(*rm));
+	rm->pd = pd;
+	rm->base = (char *)base;
+	rm->size = size;
+	rm->access = access;
+	rm->chunk_size = chunk_size ? chunk_size : REGMEM_CHUNK_SIZE;
+	while ((size + rm->chunk_size - 1) / rm->chunk_size > REGMEM_MAX_CHUNKS)
+		rm->chunk_size *= 2;
+	rm->nr_chunks = (size + rm->chunk_size - 1) / rm->chunk_size;
+
+	regmem_spawn(rm, nr_threads);
+	return 0;
+}
+
+// Wait for every queued chunk; returns -1 if any registration failed
+int
+regmem_wait(struct regmem *rm)
+{
+	int i;
+
+	for (i = 0; i < rm->nr_threads; i++)
+		pthread_join(rm->threads[i], NULL);
+	rm->nr_threads = 0;
+	return atomic_load(&rm->failed) ? -1 : 0;
+}
+
+// Register synchronously (still in parallel across chunks)
+int
+regmem_register(struct regmem *rm, struct ibv_pd *pd, void *base, size_t size,
+                size_t chunk_size, int access, int nr_threads)
+{
+	regmem_start(rm, pd, base, size, chunk_size, access, nr_threads);
+	return regmem_wait(rm);
+}
+
+// Grow the region to new_size by registering only the new chunks. The
+// caller must already have [base, base + new_size) mapped. A partial last
+// chunk is registered again at its new length, so its rkey changes and
+// nobody may be using it meanwhile; the other MRs stay untouched.
+int
+regmem_extend(struct regmem *rm, size_t new_size)
+{
+	struct ibv_mr *mr;
+	int nr_chunks, first;
+
+	if (new_size <= rm->size)
+		return 0;
+	nr_chunks = (new_size + rm->chunk_size - 1) / rm->chunk_size;
+	if (nr_chunks > REGMEM_MAX_CHUNKS)
+	{
+		fprintf(stderr, "regmem_extend: too many chunks\n");
+		return -1;
+	}
+
+	regmem_wait(rm);
+	first = rm->nr_chunks;
+	if (first && rm->size < (size_t)first * rm->chunk_size)
+	{
+		first--;
+		mr = atomic_exchange(&rm->mrs[first], NULL);
+		if (mr)
+		{
+			ibv_dereg_mr(mr);
+			atomic_fetch_sub(&rm->nr_ready, 1);
+		}
+	}
+	atomic_store(&rm->next_chunk, first);
+	rm->size = new_size;
+	rm->nr_chunks = nr_chunks;
+	regmem_spawn(rm, 0);
+	return regmem_wait(rm);
+}
+
+// Chunk idx, or NULL while it is still being registered
+struct ibv_mr *
+regmem_chunk(struct regmem *rm, int idx)
+{
+	if (idx < 0 || idx >= rm->nr_chunks)
+		return NULL;
+	return atomic_load(&rm->mrs[idx]);
+}
+
+struct ibv_mr *
+regmem_lookup(struct regmem *rm, const void *addr)
+{
+	size_t off = (const char *)addr - rm->base;
+
+	if ((const char *)addr < rm->base || off >= rm->size)
+		return NULL;
+	return regmem_chunk(rm, off / rm->chunk_size);
+}
+
+void
+regmem_release(struct regmem *rm)
+{
+	struct ibv_mr *mr;
+	int i;
+
+	regmem_wait(rm);
+	for (i = 0; i < rm->nr_chunks; i++)
+	{
+		mr = atomic_exchange(&rm->mrs[i], NULL);
+		if (mr)
+			ibv_dereg_mr(mr);
+	}
+	rm->nr_chunks = 0;
+	rm->size = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef REGMEM_H
+#define REGMEM_H
+
+#include <infiniband/verbs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define REGMEM_CHUNK_SIZE (1UL << 30) // 1GB per MR by default
+#define REGMEM_MAX_CHUNKS 1024
+#define REGMEM_MAX_THREADS 8
+
+// A memory region registered as a series of equally sized MRs. Registration
+// runs on worker threads so it can overlap with other setup work; chunks
+// become usable individually as soon as their own ibv_reg_mr returns.
+struct regmem
+{
+	struct ibv_pd *pd;
+	char *base;
+	size_t size; // bytes covered by the chunks queued so far
+	size_t chunk_size;
+	int access;
+	int nr_chunks;
+	struct ibv_mr *_Atomic mrs[REGMEM_MAX_CHUNKS];
+
+	atomic_int next_chunk; // next chunk index a worker will claim
+	atomic_int nr_ready;
+	atomic_int failed;
+	pthread_t threads[REGMEM_MAX_THREADS];
+	int nr_threads;
+};
+
+int regmem_start(struct regmem *rm, struct ibv_pd *pd, void *base, size_t size,
+                 size_t chunk_size, int access, int nr_threads);
+int regmem_wait(struct regmem *rm);
+int regmem_register(struct regmem *rm, struct ibv_pd *pd, void *base, size_t size,
+                    size_t chunk_size, int access, int nr_threads);
+int regmem_extend(struct regmem *rm, size_t new_size);
+struct ibv_mr *regmem_chunk(struct regmem *rm, int idx);
+struct ibv_mr *regmem_lookup(struct regmem *rm, const void *addr);
+void regmem_release(struct regmem *rm);
+
+#endif
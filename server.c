@@ -6,42 +6,111 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include "proto.h"
+#include "regmem.h"
+#include "pstore.h"
+#include "tier.h"
+#include "hugealloc.h"
+#include "topology.h"
 
 #define PAGE_SIZE (2 * 1024 * 1024) // 2MB
+#define INIT_THREADS 16             // upper bound on buffer init workers
+#define CTRL_SEND_SLOTS 4
+#define CTRL_INLINE 64 // max_inline_data asked for; control messages up to it skip the DMA read
+#define PUSH_DEPTH 4 // pages pushed ahead of a detected stream
+#define CM_CHECK_INTERVAL 4096 // CQ polls between checks for CM events
+#define SERVER_FEATURES (FEAT_CTRL | FEAT_NOTIFY | FEAT_LANDING | FEAT_TIERING | FEAT_BULK_QP)
+#define BULK_RECV_SLOTS 16  // receives for IMM notifications on the bulk QP
+#define PUSH_MAX_INFLIGHT 2 // pushes in flight, bounding what demand READs queue behind
 
-// Structure to hold remote memory region information
-struct mr_info
-{
-	uintptr_t remote_addr;
-	uint32_t rkey;
-	size_t mem_size; // used for client request allocation
-};
+// work request ids
+#define WR_RECV 0x100      // | receive slot
+#define WR_CTRL_SEND 0x200 // | send slot
+#define WR_PUSH 0x300      // push-prefetch write
+#define WR_BULK_RECV 0x400 // receive on the bulk QP
+#define WR_CTRL_INLINE 0x500 // inline control send, holds no send slot
+#define WR_KIND(id) ((id) & ~0xffULL)
+#define WR_SLOT(id) ((int)((id) & 0xff))
+
+// #define MR_BACKGROUND // accept once the first chunk is registered
+
+#define DEFAULT_LISTEN "10.10.10.221"
+#define DEFAULT_PORT 5000
 
 // Global variables
 struct sockaddr_in addr;
+const char *listen_host = DEFAULT_LISTEN; // -l host[:port]
+int listen_port = DEFAULT_PORT;
 struct rdma_cm_id *listener = NULL, *conn = NULL;
+struct rdma_cm_id *bulk_conn; // the client's low-priority connection, if any
+int bulk_ready;               // bulk_conn is established
 struct rdma_event_channel *ec = NULL;
 struct ibv_pd *pd;
-struct ibv_mr *mr;
+struct regmem region; // buffer, registered in MR chunks
+struct ibv_mr *ctrl_mr;
 struct ibv_cq *cq;
 struct ibv_qp_init_attr qp_attr;
 char *buffer;
+struct huge_mem buffer_mem; // anonymous (not file-backed) buffer
+int nic_node = -1;  // NUMA node of the RDMA device
+int interleave;     // -i: spread the pool over all nodes instead of nic_node
+char *ctrl_buf; // CTRL_RECV_SLOTS receive slots, then CTRL_SEND_SLOTS send slots
+int ctrl_send_busy[CTRL_SEND_SLOTS];
+uint32_t max_inline; // largest send the client QP carries inline
+int nr_published; // chunks announced to the client
+char published[REGMEM_MAX_CHUNKS];
 uint64_t client_addr;
 uint32_t client_rkey;
-size_t buffer_size;
+size_t buffer_size; // logical size requested by the client
+size_t region_size; // bytes of DRAM actually mapped and registered
+int odp;         // -o: register with IBV_ACCESS_ON_DEMAND instead of pinning
+long hot_pages;  // -H: pages to prefetch right after registration in ODP mode
+const char *backing_path; // -f: keep the region in this file across restarts
+struct pstore store;
+const char *tier_path; // -s: demote cold pages to this file
+long dram_pages;       // -d: DRAM slots kept when tiering
+long grow_pages;       // -g: room to grow the region to, for later clients
+struct tier tier;
+
+// Push-prefetch into the client's landing ring (after CTRL_LANDING)
+uint64_t landing_addr;
+uint32_t landing_rkey;
+uint32_t landing_slots;
+uint32_t push_credits; // landing slots the client has freed for us
+uint64_t push_seq;     // pushes issued; the next one lands in push_seq % landing_slots
+int push_inflight;
+int push_unsignaled; // pushes posted since the last signaled one
+uint32_t last_access = PAGE_NONE;
+int64_t last_stride;
+uint32_t last_pushed = PAGE_NONE; // furthest page pushed for the current stride
+uint64_t pushes;
+int conn_lost; // the client disconnected or a work request failed
+uint32_t features; // FEAT_* agreed with the current client
+
+// Hybrid polling (-w): after spin_ns without a completion the main loop
+// arms the CQ and sleeps on its completion channel and the CM channel
+long spin_ns = -1; // -1: busy-poll only
+struct ibv_comp_channel *comp_chan;
+int cq_armed;
+uint64_t sleeps;
 
 // Function to post a receive work request
 void
-post_receive()
+post_receive(int slot)
 {
 	// printf("Posting a receive WR...\n");
 	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
 	struct ibv_sge recv_sge;
 	memset(&recv_wr, 0, sizeof(recv_wr));
-	recv_wr.wr_id = 1;
-	recv_sge.addr = (uintptr_t)buffer;
-	recv_sge.length = buffer_size;
-	recv_sge.lkey = mr->lkey;
+	recv_wr.wr_id = WR_RECV | slot;
+	recv_sge.addr = (uintptr_t)ctrl_buf + slot * CTRL_MSG_SIZE;
+	recv_sge.length = CTRL_MSG_SIZE;
+	recv_sge.lkey = ctrl_mr->lkey;
 	recv_wr.sg_list = &recv_sge;
 	recv_wr.num_sge = 1;
 	if (ibv_post_recv(conn->qp, &recv_wr, &bad_recv_wr))
@@ -51,149 +120,1045 @@ post_receive()
 	}
 }
 
+// Receive for an IMM notification (no payload) on the bulk QP
 void
-init_buffer()
+post_bulk_receive()
 {
-	int i;
-	char str[100];
+	struct ibv_recv_wr recv_wr, *bad_recv_wr = NULL;
 
-	for (i = 0; i < buffer_size / PAGE_SIZE; i++)
+	memset(&recv_wr, 0, sizeof(recv_wr));
+	recv_wr.wr_id = WR_BULK_RECV;
+	recv_wr.num_sge = 0;
+	if (ibv_post_recv(bulk_conn->qp, &recv_wr, &bad_recv_wr))
 	{
-		snprintf(str, sizeof(str), "Page [%d]", i);
-		strcpy(buffer + i * PAGE_SIZE, str);
-		printf("set %s\n", str);
+		perror("ibv_post_recv");
+		exit(1);
 	}
 }
 
-// Main loop to handle client requests and send responses
-void
-main_loop(uint64_t client_addr, uint32_t client_rkey)
+void handle_wc(struct ibv_wc *wc);
+
+// Poll the CQ once and dispatch whatever completed; 1 if something did
+int
+poll_once()
 {
 	struct ibv_wc wc;
 
-	while (1)
-	{
-		// printf("Waiting for client request...\n");
-		post_receive();
+	if (ibv_poll_cq(cq, 1, &wc) < 1)
+		return 0;
+	handle_wc(&wc);
+	return 1;
+}
+
+uint64_t
+now_ns()
+{
+	struct timespec ts;
 
-		while (ibv_poll_cq(cq, 1, &wc) < 1)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The CQ has been quiet for spin_ns. The first call arms it and returns,
+// so that the caller polls once more and catches a completion that raced
+// the arming; the next one sleeps until the CQ or the CM channel has an
+// event.
+void
+idle_wait()
+{
+	struct pollfd fds[2];
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+
+	if (!cq_armed)
+	{
+		if (ibv_req_notify_cq(cq, 0))
 		{
+			perror("ibv_req_notify_cq");
+			exit(1);
 		}
-		if (wc.status != IBV_WC_SUCCESS || wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+		cq_armed = 1;
+		return;
+	}
+	fds[0].fd = comp_chan->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ec->fd;
+	fds[1].events = POLLIN;
+	if (poll(fds, 2, -1) < 0)
+		return; // a signal; the caller polls and comes back
+	sleeps++;
+	if (fds[0].revents & POLLIN)
+	{
+		if (ibv_get_cq_event(comp_chan, &ev_cq, &ev_ctx))
 		{
-			fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
-			        ibv_wc_status_str(wc.status), wc.status, (int)wc.wr_id);
+			perror("ibv_get_cq_event");
 			exit(1);
 		}
+		ibv_ack_cq_events(ev_cq, 1);
+		cq_armed = 0;
+	}
+}
 
-		// printf("Received request: %s\n", buffer);
+// Send a control message from a free send slot
+void
+send_ctrl(const void *msg, size_t len)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge send_sge;
+	char *slot_buf;
+	int slot = -1, i;
 
+	// small messages are copied into the WR at post time and need no slot
+	if (len <= max_inline)
+	{
+		memset(&send_wr, 0, sizeof(send_wr));
+		send_wr.wr_id = WR_CTRL_INLINE;
+		send_wr.opcode = IBV_WR_SEND;
+		send_wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+		send_sge.addr = (uintptr_t)msg;
+		send_sge.length = len;
+		send_wr.sg_list = &send_sge;
+		send_wr.num_sge = 1;
+		if (ibv_post_send(conn->qp, &send_wr, &bad_send_wr))
+		{
+			perror("ibv_post_send");
+			exit(1);
+		}
+		return;
 	}
+
+	while (slot < 0)
+	{
+		for (i = 0; i < CTRL_SEND_SLOTS; i++)
+		{
+			if (!ctrl_send_busy[i])
+			{
+				slot = i;
+				break;
+			}
+		}
+		if (slot < 0)
+			poll_once();
+	}
+
+	slot_buf = ctrl_buf + (CTRL_RECV_SLOTS + slot) * CTRL_MSG_SIZE;
+	memcpy(slot_buf, msg, len);
+	memset(&send_wr, 0, sizeof(send_wr));
+	send_wr.wr_id = WR_CTRL_SEND | slot;
+	send_wr.opcode = IBV_WR_SEND;
+	send_wr.send_flags = IBV_SEND_SIGNALED;
+	send_sge.addr = (uintptr_t)slot_buf;
+	send_sge.length = len;
+	send_sge.lkey = ctrl_mr->lkey;
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	if (ibv_post_send(conn->qp, &send_wr, &bad_send_wr))
+	{
+		perror("ibv_post_send");
+		exit(1);
+	}
+	ctrl_send_busy[slot] = 1;
 }
 
-int
-main(int argc, char **argv)
+// Announce every registered chunk the client has not heard about yet
+void
+publish_chunks()
 {
-	// Initialize server address
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(5000);
-	inet_pton(AF_INET, "10.10.10.221", &addr.sin_addr);
+	char msg_buf[CTRL_MSG_SIZE];
+	struct mr_table_msg *msg = (struct mr_table_msg *)msg_buf;
+	struct ibv_mr *chunk_mr;
+	int i;
 
-	// Create event channel
-	printf("Creating event channel...\n");
-	ec = rdma_create_event_channel();
-	if (!ec)
+	msg->base = (uintptr_t)buffer;
+	msg->chunk_size = region.chunk_size;
+	msg->nr_chunks = region.nr_chunks;
+	msg->count = 0;
+
+	for (i = 0; i <= region.nr_chunks; i++)
 	{
-		perror("rdma_create_event_channel");
-		return 1;
+		chunk_mr = i < region.nr_chunks && !published[i] ? regmem_chunk(&region, i) : NULL;
+		if (chunk_mr && msg->count < MR_TABLE_MSG_MAX)
+		{
+			if (msg->count == 0)
+				msg->first = i;
+			msg->entries[msg->count].addr = (uintptr_t)chunk_mr->addr;
+			msg->entries[msg->count].len = chunk_mr->length;
+			msg->entries[msg->count].rkey = chunk_mr->rkey;
+			msg->entries[msg->count].flags = 0;
+			msg->count++;
+			published[i] = 1;
+			nr_published++;
+			continue;
+		}
+		// flush the current run of consecutive entries
+		if (msg->count)
+		{
+			msg->hdr.type = CTRL_MR_TABLE;
+			msg->hdr.len = sizeof(*msg) + msg->count * sizeof(struct mr_chunk_entry);
+			send_ctrl(msg, msg->hdr.len);
+			msg->count = 0;
+			if (chunk_mr)
+				i--; // retry this chunk in a new message
+		}
 	}
+}
 
-	// Create RDMA ID for listening
-	printf("Creating RDMA ID...\n");
-	if (rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP))
+// Slice of the buffer handed to one init worker
+struct init_work
+{
+	pthread_t thread;
+	size_t first_page;
+	size_t nr_pages;
+};
+
+struct init_work init_workers[INIT_THREADS];
+int nr_init_workers;
+size_t nr_init_pages;
+
+// Fresh anonymous mappings are zero-filled by the kernel on first touch, so
+// writing the page tag is what faults in (and zeroes) each page.
+void *
+init_worker(void *arg)
+{
+	struct init_work *work = (struct init_work *)arg;
+	size_t i;
+
+	for (i = work->first_page; i < work->first_page + work->nr_pages; i++)
 	{
-		perror("rdma_create_id");
-		return 1;
+		snprintf(buffer + i * PAGE_SIZE, PAGE_SIZE, "Page [%zu]", i);
 	}
+	return NULL;
+}
 
-	// Bind address to RDMA ID
-	printf("Binding address...\n");
-	if (rdma_bind_addr(listener, (struct sockaddr *)&addr))
+// Split the buffer from first on across worker threads; runs concurrently
+// with ibv_reg_mr
+void
+init_buffer_start(size_t first)
+{
+	size_t nr_pages = region_size / PAGE_SIZE;
+	size_t per_worker;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+
+	nr_init_pages = first < nr_pages ? nr_pages - first : 0;
+	nr_init_workers = ncpu < INIT_THREADS ? (ncpu > 0 ? ncpu : 1) : INIT_THREADS;
+	if (nr_init_workers > nr_init_pages)
+		nr_init_workers = nr_init_pages;
+	if (nr_init_workers == 0)
+		return;
+	per_worker = (nr_init_pages + nr_init_workers - 1) / nr_init_workers;
+
+	for (i = 0; i < nr_init_workers; i++)
 	{
-		perror("rdma_bind_addr");
-		return 1;
+		init_workers[i].first_page = first;
+		init_workers[i].nr_pages = first + per_worker <= nr_pages ? per_worker : nr_pages - first;
+		first += init_workers[i].nr_pages;
+		if (pthread_create(&init_workers[i].thread, NULL, init_worker, &init_workers[i]))
+		{
+			// fall back to initializing this slice inline
+			init_worker(&init_workers[i]);
+			init_workers[i].nr_pages = 0;
+		}
+		else if (!interleave)
+		{
+			topo_pin_thread(init_workers[i].thread, nic_node);
+		}
 	}
+}
 
-	// Start listening for incoming connections
-	printf("Listening...\n");
-	if (rdma_listen(listener, 10))
+void
+init_buffer_wait()
+{
+	int i;
+
+	for (i = 0; i < nr_init_workers; i++)
 	{
-		perror("rdma_listen");
-		return 1;
+		if (init_workers[i].nr_pages)
+			pthread_join(init_workers[i].thread, NULL);
 	}
+	if (nr_init_workers)
+		printf("Initialized %zu pages with %d threads\n", nr_init_pages, nr_init_workers);
+}
 
-	printf("Server is listening at %s:5000\n", "10.10.10.221");
+// Ask the NIC to fault in and map [first, first + count) pages ahead of the
+// client's accesses. Only meaningful for ODP registrations.
+void
+prefetch_pages(size_t first, size_t count)
+{
+	size_t page = first, end = first + count;
+	struct ibv_sge sge;
+	struct ibv_mr *chunk_mr;
+	size_t off, len;
 
-	// Accept incoming connection and process client requests
-	printf("Waiting for connection...\n");
-	struct rdma_cm_event *event;
-	if (rdma_get_cm_event(ec, &event))
+	if (!odp)
+		return;
+	if (end > region_size / PAGE_SIZE)
+		end = region_size / PAGE_SIZE;
+
+	while (page < end)
 	{
-		perror("rdma_get_cm_event");
-		return 1;
+		off = page * PAGE_SIZE;
+		chunk_mr = regmem_lookup(&region, buffer + off);
+		if (!chunk_mr)
+			return;
+		// one SGE per chunk, clipped to the requested range
+		len = (char *)chunk_mr->addr + chunk_mr->length - (buffer + off);
+		if (len > (end - page) * PAGE_SIZE)
+			len = (end - page) * PAGE_SIZE;
+		sge.addr = (uintptr_t)buffer + off;
+		sge.length = len;
+		sge.lkey = chunk_mr->lkey;
+		if (ibv_advise_mr(pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE, 0, &sge, 1))
+		{
+			perror("ibv_advise_mr");
+			return;
+		}
+		page += len / PAGE_SIZE;
 	}
+}
+
+// Bring a demoted page back into DRAM and tell the client where it is. The
+// client only asks while it has no reads outstanding, so the victim's slot
+// can be reused right away.
+void
+promote_page(uint32_t page)
+{
+	struct promoted_msg msg;
+	uint32_t slot = PAGE_NONE, victim = PAGE_NONE;
+
+	// a push still reading the victim's slot would send the wrong data
+	while (push_inflight)
+		poll_once();
+	if (tier_path)
+		tier_promote(&tier, page, &slot, &victim);
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.type = CTRL_PROMOTED;
+	msg.hdr.len = sizeof(msg);
+	msg.page = page;
+	msg.slot = slot;
+	msg.victim = victim;
+	send_ctrl(&msg, sizeof(msg));
+}
 
-	if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST)
+// Where page can be pushed from and the MR covering it, NULL if it cannot
+// be pushed
+char *
+push_src(uint32_t page, struct ibv_mr **mr)
+{
+	char *src;
+
+	if (page >= buffer_size / PAGE_SIZE)
+		return NULL;
+	if (tier_path)
 	{
-		fprintf(stderr, "Unexpected event: %s\n", rdma_event_str(event->event));
-		return 1;
+		// only pages already in DRAM; promoting here would cost SSD I/O
+		if (tier.page_slot[page] == TIER_NONE)
+			return NULL;
+		src = buffer + (size_t)tier.page_slot[page] * PAGE_SIZE;
 	}
 	else
 	{
-		struct mr_info *client_mr = (struct mr_info *)event->param.conn.private_data;
-		if (client_mr == NULL)
+		src = buffer + (size_t)page * PAGE_SIZE;
+	}
+	*mr = regmem_lookup(&region, src);
+	return *mr ? src : NULL;
+}
+
+// RDMA-write page from src into the client's next landing slot. Only the
+// last push of a burst is signaled; its completion accounts for the
+// unsignaled ones before it, whose count its wr_id carries.
+void
+push_page(uint32_t page, char *src, struct ibv_mr *chunk_mr, int last)
+{
+	struct ibv_send_wr send_wr, *bad_send_wr = NULL;
+	struct ibv_sge send_sge;
+
+	memset(&send_wr, 0, sizeof(send_wr));
+	send_wr.wr_id = WR_PUSH;
+	send_wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	push_unsignaled++;
+	if (last)
+	{
+		send_wr.wr_id = WR_PUSH | push_unsignaled;
+		send_wr.send_flags = IBV_SEND_SIGNALED;
+		push_unsignaled = 0;
+	}
+	send_wr.wr.rdma.remote_addr = landing_addr + (push_seq % landing_slots) * PAGE_SIZE;
+	send_wr.wr.rdma.rkey = landing_rkey;
+	send_wr.imm_data = htonl(IMM_ENCODE(IMM_OP_PUSH, page));
+	send_sge.addr = (uintptr_t)src;
+	send_sge.length = PAGE_SIZE;
+	send_sge.lkey = chunk_mr->lkey;
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	// pushes are bulk traffic and stay off the demand QP when they can
+	if (ibv_post_send(bulk_ready ? bulk_conn->qp : conn->qp, &send_wr, &bad_send_wr))
+	{
+		perror("ibv_post_send");
+		exit(1);
+	}
+	push_seq++;
+	push_credits--;
+	push_inflight++;
+	pushes++;
+}
+
+// Stride predictor: once two consecutive accesses have the same non-zero
+// stride, push the next PUSH_DEPTH pages along it that have not been pushed
+// yet, as far as the client's free landing slots and PUSH_MAX_INFLIGHT allow.
+void
+predict_and_push(uint32_t page)
+{
+	int64_t stride = last_access == PAGE_NONE ? 0 : (int64_t)page - last_access;
+	int confirmed = stride != 0 && stride == last_stride;
+	uint32_t burst[PUSH_DEPTH];
+	char *burst_src[PUSH_DEPTH];
+	struct ibv_mr *burst_mr[PUSH_DEPTH];
+	int nr_burst = 0, i;
+	int64_t next, end;
+
+	if (stride != last_stride)
+		last_pushed = PAGE_NONE;
+	last_access = page;
+	last_stride = stride;
+	if (!landing_slots || !confirmed)
+		return;
+
+	next = (int64_t)page + stride;
+	// continue after what this stream already pushed
+	if (last_pushed != PAGE_NONE && (stride > 0 ? last_pushed >= next : last_pushed <= next))
+		next = (int64_t)last_pushed + stride;
+	end = (int64_t)page + stride * (PUSH_DEPTH + 1);
+	// pick the burst first so that its last push is known
+	for (; (stride > 0 ? next < end : next > end) && nr_burst < push_credits &&
+	       push_inflight + nr_burst < PUSH_MAX_INFLIGHT;
+	     next += stride)
+	{
+		if (next < 0 || !(burst_src[nr_burst] = push_src((uint32_t)next, &burst_mr[nr_burst])))
+			break;
+		burst[nr_burst++] = (uint32_t)next;
+	}
+	for (i = 0; i < nr_burst; i++)
+	{
+		push_page(burst[i], burst_src[i], burst_mr[i], i == nr_burst - 1);
+		last_pushed = burst[i];
+	}
+}
+
+void
+handle_ctrl(struct ctrl_hdr *hdr, uint32_t len)
+{
+	struct hot_pages_msg *hot;
+	struct landing_msg *landing;
+
+	if (len < sizeof(*hdr))
+		return;
+	switch (hdr->type)
+	{
+	case CTRL_HOT_PAGES:
+		hot = (struct hot_pages_msg *)hdr;
+		if (tier_path)
+		{
+			for (uint32_t i = 0; i < hot->count; i++)
+				tier_touch(&tier, hot->first + i);
+		}
+		else
+		{
+			prefetch_pages(hot->first, hot->count);
+		}
+		break;
+	case CTRL_PROMOTE:
+		promote_page(((struct promote_msg *)hdr)->page);
+		break;
+	case CTRL_LANDING:
+		landing = (struct landing_msg *)hdr;
+		if (landing->slot_size != PAGE_SIZE)
 		{
-			fprintf(stderr, "Private data is NULL\n");
-			return 1;
+			fprintf(stderr, "Landing slots of %lu bytes not supported\n", landing->slot_size);
+			break;
 		}
-		memcpy(&client_addr, &client_mr->remote_addr, sizeof(client_addr));
-		memcpy(&client_rkey, &client_mr->rkey, sizeof(client_rkey));
-		memcpy(&buffer_size, &client_mr->mem_size, sizeof(buffer_size));
+		landing_addr = landing->addr;
+		landing_rkey = landing->rkey;
+		landing_slots = landing->nr_slots;
+		push_credits = landing->nr_slots;
+		push_seq = 0;
+		printf("Push-prefetch into %u client slots\n", landing_slots);
+		break;
+	default:
+		fprintf(stderr, "Unknown control message %u\n", hdr->type);
+		break;
+	}
+}
 
-		printf("client_addr: %lx\n", client_addr);
-		printf("client_rkey: %u\n", client_rkey);
-		printf("buffer_size: %lx\n", buffer_size);
+void
+handle_imm(uint32_t imm)
+{
+	switch (IMM_OP(imm))
+	{
+	case IMM_OP_PAGE_WRITE:
+		if (backing_path)
+			pstore_mark_valid(&store, IMM_PAGE(imm));
+		if (tier_path)
+			tier_touch(&tier, IMM_PAGE(imm));
+		break;
+	case IMM_OP_ACCESS:
+		if (tier_path)
+			tier_touch(&tier, IMM_PAGE(imm));
+		predict_and_push(IMM_PAGE(imm));
+		break;
+	case IMM_OP_CREDIT:
+		push_credits += IMM_PAGE(imm);
+		if (push_credits > landing_slots)
+			push_credits = landing_slots;
+		break;
+	default:
+		break;
 	}
-	conn = event->id;
+}
+
+// Tell the client what it will find in the region
+void
+send_region_info()
+{
+	struct region_info_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.hdr.type = CTRL_REGION_INFO;
+	msg.hdr.len = sizeof(msg);
+	msg.nr_pages = buffer_size / PAGE_SIZE;
+	if (backing_path)
+	{
+		msg.flags = REGION_PERSISTENT | (store.warm ? REGION_WARM : 0);
+		msg.nr_valid = store.nr_valid;
+	}
+	if (tier_path)
+	{
+		msg.flags |= REGION_TIERED;
+		msg.nr_slots = tier.nr_slots;
+		// an earlier client moved pages around
+		if (tier.promotions)
+			msg.flags |= REGION_SLOTS_MOVED;
+	}
+	send_ctrl(&msg, sizeof(msg));
+}
+
+// Check that the device can serve remote reads and writes from an ODP MR
+int
+odp_supported(struct ibv_context *ctx)
+{
+	struct ibv_device_attr_ex attr;
+	uint32_t need = IBV_ODP_SUPPORT_READ | IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_RECV;
+
+	memset(&attr, 0, sizeof(attr));
+	if (ibv_query_device_ex(ctx, NULL, &attr))
+		return 0;
+	if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT))
+		return 0;
+	return (attr.odp_caps.per_transport_caps.rc_odp_caps & need) == need;
+}
+
+void
+handle_wc(struct ibv_wc *wc)
+{
+	// A failed connection only ends this client's session: flushed work
+	// requests still release their slots so nothing waits on them forever
+	if (wc->status != IBV_WC_SUCCESS)
+	{
+		if (!conn_lost)
+			fprintf(stderr, "Failed status %s (%d) for wr_id %d\n",
+			        ibv_wc_status_str(wc->status), wc->status, (int)wc->wr_id);
+		conn_lost = 1;
+		if (WR_KIND(wc->wr_id) == WR_CTRL_SEND)
+			ctrl_send_busy[WR_SLOT(wc->wr_id)] = 0;
+		else if (WR_KIND(wc->wr_id) == WR_PUSH)
+			push_inflight -= WR_SLOT(wc->wr_id);
+		// WR_CTRL_INLINE holds nothing
+		return;
+	}
+	if (WR_KIND(wc->wr_id) == WR_BULK_RECV)
+	{
+		handle_imm(ntohl(wc->imm_data));
+		post_bulk_receive();
+		return;
+	}
+
+	switch (WR_KIND(wc->wr_id))
+	{
+	case WR_CTRL_SEND:
+		ctrl_send_busy[WR_SLOT(wc->wr_id)] = 0;
+		break;
+	case WR_CTRL_INLINE:
+		// the message was copied at post time, nothing to release
+		break;
+	case WR_PUSH:
+		push_inflight -= WR_SLOT(wc->wr_id);
+		break;
+	case WR_RECV:
+		if (wc->opcode == IBV_WC_RECV)
+		{
+			handle_ctrl((struct ctrl_hdr *)(ctrl_buf + WR_SLOT(wc->wr_id) * CTRL_MSG_SIZE), wc->byte_len);
+		}
+		else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+		{
+			handle_imm(ntohl(wc->imm_data));
+		}
+		else
+		{
+			fprintf(stderr, "Unexpected opcode %d for wr_id %d\n", wc->opcode, (int)wc->wr_id);
+			exit(1);
+		}
+		// printf("Received request: %s\n", buffer);
+		post_receive(WR_SLOT(wc->wr_id));
+		break;
+	default:
+		fprintf(stderr, "Unknown wr_id %d\n", (int)wc->wr_id);
+		exit(1);
+	}
+}
+
+int read_hello(struct rdma_cm_event *event, struct hello_msg *hello);
+void reject_client(struct rdma_cm_event *event);
+
+// Take connect request event as the current client's bulk connection if
+// that is what it asks for: a QP on the same PD and CQ, with receives for
+// the IMM notifications the client sends on it. 0 if event was consumed,
+// -1 if it is a demand connection.
+int
+accept_bulk(struct rdma_cm_event *event)
+{
+	struct rdma_conn_param cm_params = {0};
+	struct ibv_qp_init_attr bulk_attr;
+	struct hello_msg hello;
+	int i;
+
+	if (read_hello(event, &hello) || hello.magic != HELLO_MAGIC || hello.qp_class != QP_CLASS_BULK)
+		return -1;
+	if (bulk_conn || !(features & FEAT_BULK_QP))
+	{
+		fprintf(stderr, "Unexpected bulk connection, rejecting\n");
+		reject_client(event);
+		return 0;
+	}
+	bulk_conn = event->id;
 	rdma_ack_cm_event(event);
 
+	memset(&bulk_attr, 0, sizeof(bulk_attr));
+	bulk_attr.qp_type = IBV_QPT_RC;
+	bulk_attr.send_cq = cq;
+	bulk_attr.recv_cq = cq;
+	bulk_attr.cap.max_send_wr = 16;
+	bulk_attr.cap.max_recv_wr = BULK_RECV_SLOTS;
+	bulk_attr.cap.max_send_sge = 1;
+	bulk_attr.cap.max_recv_sge = 1;
+	if (rdma_create_qp(bulk_conn, pd, &bulk_attr))
+	{
+		perror("rdma_create_qp");
+		conn_lost = 1;
+		return 0;
+	}
+	for (i = 0; i < BULK_RECV_SLOTS; i++)
+		post_bulk_receive();
+
+	hello.version = hello.version < HELLO_VERSION ? hello.version : HELLO_VERSION;
+	hello.len = sizeof(hello);
+	hello.features = features;
+	cm_params.private_data = &hello;
+	cm_params.private_data_len = sizeof(hello);
+	cm_params.responder_resources = 1;
+	cm_params.initiator_depth = 1;
+	cm_params.rnr_retry_count = 7;
+	if (rdma_accept(bulk_conn, &cm_params))
+	{
+		perror("rdma_accept");
+		conn_lost = 1;
+	}
+	return 0;
+}
+
+// Main loop to handle client requests and send responses, until the
+// client disconnects or its QP fails. A client reconnecting before its old
+// connection is noticed as dead replaces it: its connect request is
+// returned for main() to serve next.
+struct rdma_cm_event *
+main_loop(uint64_t client_addr, uint32_t client_rkey)
+{
+	struct rdma_cm_event *event;
+	unsigned int polls = 0;
+	uint64_t idle_since = 0;
+	int check_cm;
+
+	while (!conn_lost)
+	{
+		check_cm = ++polls % CM_CHECK_INTERVAL == 0;
+		if ((features & FEAT_CTRL) && nr_published < region.nr_chunks)
+		{
+			// chunks still registering in the background: keep spinning
+			publish_chunks();
+			idle_since = 0;
+		}
+		if (poll_once())
+		{
+			idle_since = 0;
+		}
+		else if (spin_ns >= 0)
+		{
+			if (!idle_since)
+			{
+				idle_since = now_ns();
+			}
+			else if (now_ns() - idle_since >= (uint64_t)spin_ns)
+			{
+				idle_wait();
+				check_cm = 1; // the wakeup may have been a CM event
+			}
+		}
+		if (!check_cm || rdma_get_cm_event(ec, &event))
+			continue;
+		switch (event->event)
+		{
+		case RDMA_CM_EVENT_CONNECT_REQUEST:
+			if (!accept_bulk(event))
+				continue;
+			printf("New connection request, dropping the current client\n");
+			return event;
+		case RDMA_CM_EVENT_ESTABLISHED:
+			if (event->id == bulk_conn)
+			{
+				bulk_ready = 1;
+				printf("Bulk connection up, pushes move to it\n");
+			}
+			break;
+		case RDMA_CM_EVENT_DISCONNECTED:
+		case RDMA_CM_EVENT_DEVICE_REMOVAL:
+			if (event->id == conn || event->id == bulk_conn)
+				conn_lost = 1;
+			break;
+		default:
+			break;
+		}
+		rdma_ack_cm_event(event);
+	}
+	return NULL;
+}
+
+// Forget everything about the last client; the region and its contents stay
+void
+reset_connection()
+{
+	conn_lost = 0;
+	features = 0;
+	bulk_conn = NULL;
+	bulk_ready = 0;
+	memset(ctrl_send_busy, 0, sizeof(ctrl_send_busy));
+	nr_published = 0;
+	memset(published, 0, sizeof(published));
+	landing_addr = 0;
+	landing_rkey = 0;
+	landing_slots = 0;
+	push_credits = 0;
+	push_seq = 0;
+	push_inflight = 0;
+	push_unsignaled = 0;
+	cq_armed = 0;
+	last_access = PAGE_NONE;
+	last_stride = 0;
+	last_pushed = PAGE_NONE;
+}
+
+// Allocate, initialize and register the region on the first client's
+// device, sized by its request; later clients are served from it as is
+int
+setup_region()
+{
 	// Allocate Protection Domain
 	printf("Allocating PD...\n");
 	pd = ibv_alloc_pd(conn->verbs);
 	if (!pd)
 	{
 		perror("ibv_alloc_pd");
-		return 1;
+		return -1;
 	}
 
+	// Serve from memory next to the NIC and poll from its cores
+	nic_node = topo_device_node(conn->verbs);
+	if (nic_node >= 0 && !topo_pin_thread(pthread_self(), nic_node))
+		printf("%s is on NUMA node %d; polling thread pinned to its %d cpus\n",
+		       ibv_get_device_name(conn->verbs->device), nic_node, topo_node_cpu_count(nic_node));
+	else
+		printf("%s: NUMA node unknown, no placement\n", ibv_get_device_name(conn->verbs->device));
+
 	// Allocate buffer using huge pages and register memory
 	printf("Allocating buffer and registering memory...\n");
-	buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
-	if (buffer == MAP_FAILED)
+	if (odp && !odp_supported(conn->verbs))
 	{
-		perror("mmap");
-		return 1;
+		printf("ODP not supported by %s, pinning the buffer instead\n",
+		       ibv_get_device_name(conn->verbs->device));
+		odp = 0;
+	}
+	if (backing_path)
+	{
+		if (pstore_open(&store, backing_path, buffer_size, PAGE_SIZE, odp))
+			return -1;
+		buffer = store.data;
+		printf("%s start from %s: %zu of %zu pages valid\n", store.warm ? "Warm" : "Cold",
+		       backing_path, store.nr_valid, store.nr_pages);
+	}
+	else
+	{
+		// With ODP, pages are only backed once the client touches them, so a
+		// THP region need not commit memory up front. hugetlb pages are still
+		// reserved, so a short pool falls back here rather than failing later.
+		if (huge_alloc_growable(&buffer_mem, region_size, (size_t)grow_pages * PAGE_SIZE,
+		                        odp ? HUGE_NORESERVE : 0))
+			return -1;
+		buffer = buffer_mem.addr;
+		printf("Buffer: %zu bytes of %s pages\n", buffer_mem.size, huge_kind_str(buffer_mem.kind));
+		// before anything faults the pages in
+		if (interleave ? !topo_interleave_memory(buffer, buffer_mem.size)
+		               : !topo_bind_memory(buffer, buffer_mem.size, nic_node))
+			printf("Buffer: %s\n", interleave ? "interleaved over all NUMA nodes" : "on the NIC's NUMA node");
+	}
+	// Tagging would fault in every page and defeat ODP, and would overwrite
+	// (or dirty) the pages of a backing file
+	if (!odp && !backing_path)
+		init_buffer_start(0);
+	if (tier_path)
+	{
+		if (tier_open(&tier, tier_path, buffer, PAGE_SIZE, buffer_size / PAGE_SIZE,
+		              region_size / PAGE_SIZE))
+			return -1;
+		printf("Tiering %u pages over %u DRAM slots and %s\n", tier.nr_pages,
+		       tier.nr_slots, tier_path);
+	}
+	regmem_start(&region, pd, buffer, region_size, REGMEM_CHUNK_SIZE,
+	             IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ |
+	                 (odp ? IBV_ACCESS_ON_DEMAND : 0),
+	             0);
+
+	ctrl_buf = malloc((CTRL_RECV_SLOTS + CTRL_SEND_SLOTS) * CTRL_MSG_SIZE);
+	if (!ctrl_buf)
+	{
+		perror("malloc");
+		return -1;
+	}
+	ctrl_mr = ibv_reg_mr(pd, ctrl_buf, (CTRL_RECV_SLOTS + CTRL_SEND_SLOTS) * CTRL_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+	if (!ctrl_mr)
+	{
+		perror("ibv_reg_mr");
+		return -1;
 	}
-	memset(buffer, 0, buffer_size);
-	mr = ibv_reg_mr(pd, buffer, buffer_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
-	printf("key: %u\n", mr->rkey);
+
+	// Page tags must be in place before the client can write into the region
+	init_buffer_wait();
+
+#ifdef MR_BACKGROUND
+	// Remaining chunks are announced from main_loop as they complete
+	while (!regmem_chunk(&region, 0) && !atomic_load(&region.failed))
+	{
+	}
+#else
+	regmem_wait(&region);
+#endif
+	if (atomic_load(&region.failed) || !regmem_chunk(&region, 0))
+	{
+		fprintf(stderr, "Failed to register buffer\n");
+		return -1;
+	}
+	printf("key: %u (%d chunks of %zu bytes%s)\n", regmem_chunk(&region, 0)->rkey,
+	       region.nr_chunks, region.chunk_size, odp ? ", on-demand" : "");
 	printf("addr: %lx\n", (uintptr_t)buffer);
-	init_buffer();
+	if (hot_pages)
+		prefetch_pages(0, hot_pages);
+	return 0;
+}
+
+// Grow the region in place for a client asking for more than the first
+// one did, within the address space reserved by -g. Only the new pages are
+// tagged and registered; the client gets the new chunks, and the last one
+// if it was registered again, in its CTRL_MR_TABLE like any other.
+int
+grow_region(size_t size)
+{
+	size_t old_size = region_size, old_mapped = buffer_mem.size;
+
+	if (backing_path || tier_path || size > buffer_mem.reserved)
+		return -1;
+	if (huge_grow(&buffer_mem, size, odp ? HUGE_NORESERVE : 0))
+		return -1;
+	// the new pages only; the old ones are placed and possibly faulted in
+	if (buffer_mem.size > old_mapped)
+	{
+		if (interleave)
+			topo_interleave_memory(buffer + old_mapped, buffer_mem.size - old_mapped);
+		else
+			topo_bind_memory(buffer + old_mapped, buffer_mem.size - old_mapped, nic_node);
+	}
+	region_size = size;
+	if (!odp)
+	{
+		init_buffer_start(old_size / PAGE_SIZE);
+		init_buffer_wait();
+	}
+	if (regmem_extend(&region, region_size))
+	{
+		fprintf(stderr, "Failed to register the grown region\n");
+		region_size = region.size;
+		return -1;
+	}
+	buffer_size = region_size;
+	printf("Region grown to %zu pages (%d chunks of %zu bytes)\n", region_size / PAGE_SIZE,
+	       region.nr_chunks, region.chunk_size);
+	return 0;
+}
+
+void
+reject_client(struct rdma_cm_event *event)
+{
+	struct rdma_cm_id *id = event->id;
+
+	rdma_reject(id, NULL, 0);
+	rdma_ack_cm_event(event);
+	rdma_destroy_id(id);
+}
+
+// Read the client's handshake from the connect request. An mr_info from an
+// old client reads as a version 0 hello with no features, one outstanding
+// read and the pages of this server.
+int
+read_hello(struct rdma_cm_event *event, struct hello_msg *hello)
+{
+	const void *data = event->param.conn.private_data;
+	size_t len = event->param.conn.private_data_len;
+	struct mr_info legacy;
+
+	memset(hello, 0, sizeof(*hello));
+	if (!data)
+		return -1;
+	memcpy(hello, data, len < sizeof(*hello) ? len : sizeof(*hello));
+	if (hello->magic == HELLO_MAGIC)
+	{
+		// fields a shorter (older) hello does not have
+		if (hello->len < sizeof(*hello))
+			memset((char *)hello + hello->len, 0, sizeof(*hello) - hello->len);
+		return 0;
+	}
+
+	memset(&legacy, 0, sizeof(legacy));
+	memcpy(&legacy, data, len < sizeof(legacy) ? len : sizeof(legacy));
+	memset(hello, 0, sizeof(*hello));
+	hello->addr = legacy.remote_addr;
+	hello->rkey = legacy.rkey;
+	hello->mem_size = legacy.mem_size;
+	hello->page_sizes = PAGE_SIZE;
+	hello->max_rd = 1;
+	return 0;
+}
+
+// Accept the client behind connect request event and serve it until it
+// goes away. Returns a connect request that replaced it, if any.
+struct rdma_cm_event *
+serve_client(struct rdma_cm_event *event)
+{
+	struct rdma_cm_event *next;
+	struct ibv_device_attr dev_attr;
+	struct hello_msg hello, reply;
+	uint64_t page_sizes;
+	size_t size;
+	int max_rd;
+
+	if (read_hello(event, &hello))
+	{
+		fprintf(stderr, "Private data is NULL\n");
+		reject_client(event);
+		return NULL;
+	}
+	if (hello.qp_class != QP_CLASS_DEMAND)
+	{
+		fprintf(stderr, "Bulk connection without a client, rejecting\n");
+		reject_client(event);
+		return NULL;
+	}
+	client_addr = hello.addr;
+	client_rkey = hello.rkey;
+	size = hello.mem_size;
+	printf("client_addr: %lx\n", client_addr);
+	printf("client_rkey: %u\n", client_rkey);
+	printf("buffer_size: %lx\n", size);
+
+	// Settle on the largest page size both sides support, the lower read
+	// depth and the features both use
+	page_sizes = hello.page_sizes & PAGE_SIZE;
+	if (!page_sizes)
+	{
+		fprintf(stderr, "Client page sizes %lx do not include %d, rejecting\n",
+		        hello.page_sizes, PAGE_SIZE);
+		reject_client(event);
+		return NULL;
+	}
+	page_sizes = 1ULL << (63 - __builtin_clzll(page_sizes));
+	features = hello.features & SERVER_FEATURES;
+	if (tier_path && !(features & FEAT_TIERING))
+	{
+		fprintf(stderr, "Client cannot read a tiered region, rejecting\n");
+		reject_client(event);
+		return NULL;
+	}
+	max_rd = hello.max_rd ? hello.max_rd : 1;
+	if (!ibv_query_device(event->id->verbs, &dev_attr) && dev_attr.max_qp_rd_atom < max_rd)
+		max_rd = dev_attr.max_qp_rd_atom;
+	printf("Handshake v%u: %lu byte pages, %d outstanding reads, features %x\n",
+	       hello.version, page_sizes, max_rd, features);
+
+	// The region is set up once and outlives its clients, so a client
+	// that reconnects finds its pages where it left them; it only grows
+	if (pd && (event->id->verbs != pd->context || (size > buffer_size && grow_region(size))))
+	{
+		fprintf(stderr, "Client does not fit the existing region, rejecting\n");
+		reject_client(event);
+		return NULL;
+	}
+	conn = event->id;
+	rdma_ack_cm_event(event);
+	if (!pd)
+	{
+		buffer_size = size;
+		region_size = buffer_size;
+		if (tier_path && (size_t)dram_pages * PAGE_SIZE < buffer_size)
+			region_size = (size_t)dram_pages * PAGE_SIZE;
+		if (setup_region())
+			exit(1);
+	}
+	// Without a chunk table the client only ever learns the first rkey
+	if (!(features & FEAT_CTRL) && region.nr_chunks > 1)
+	{
+		fprintf(stderr, "Region spans %d MRs and the client takes no chunk table, rejecting\n",
+		        region.nr_chunks);
+		rdma_reject(conn, NULL, 0);
+		rdma_destroy_id(conn);
+		conn = NULL;
+		reset_connection();
+		return NULL;
+	}
 
 	// Create completion queue
 	printf("Creating completion queue...\n");
-	cq = ibv_create_cq(conn->verbs, 10, NULL, NULL, 0);
+	if (spin_ns >= 0)
+	{
+		comp_chan = ibv_create_comp_channel(conn->verbs);
+		if (!comp_chan)
+		{
+			perror("ibv_create_comp_channel");
+			exit(1);
+		}
+		// drained without blocking, the CM channel may be what woke us
+		fcntl(comp_chan->fd, F_SETFL, fcntl(comp_chan->fd, F_GETFL) | O_NONBLOCK);
+	}
+	cq = ibv_create_cq(conn->verbs, 128, NULL, comp_chan, 0); // demand and bulk QP
+	if (!cq)
+	{
+		perror("ibv_create_cq");
+		exit(1);
+	}
 
 	// Create queue pair
 	printf("Creating queue pair...\n");
@@ -201,28 +1166,59 @@ main(int argc, char **argv)
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.send_cq = cq;
 	qp_attr.recv_cq = cq;
-	qp_attr.cap.max_send_wr = 10;
-	qp_attr.cap.max_recv_wr = 10;
+	qp_attr.cap.max_send_wr = 32;
+	qp_attr.cap.max_recv_wr = 16;
 	qp_attr.cap.max_send_sge = 1;
 	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.cap.max_inline_data = CTRL_INLINE;
 	if (rdma_create_qp(conn, pd, &qp_attr))
 	{
-		perror("rdma_create_qp");
-		return 1;
+		// not every device sends inline; do without rather than fail
+		qp_attr.cap.max_inline_data = 0;
+		if (rdma_create_qp(conn, pd, &qp_attr))
+		{
+			perror("rdma_create_qp");
+			exit(1);
+		}
 	}
+	max_inline = qp_attr.cap.max_inline_data;
+
+	for (int i = 0; i < CTRL_RECV_SLOTS; i++)
+		post_receive(i);
 
 	// Accept RDMA connection
 	printf("Accepting RDMA connection...\n");
 	struct rdma_conn_param cm_params = {0};
-	struct mr_info mr_info = {(uintptr_t)buffer, mr->rkey};
-	cm_params.private_data = &mr_info;
-	cm_params.private_data_len = sizeof(mr_info);
-	cm_params.responder_resources = 1;
+	struct mr_info mr_info = {(uintptr_t)buffer, regmem_chunk(&region, 0)->rkey, buffer_size};
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = HELLO_MAGIC;
+	reply.version = hello.version < HELLO_VERSION ? hello.version : HELLO_VERSION;
+	reply.len = sizeof(reply);
+	reply.addr = (uintptr_t)buffer;
+	reply.rkey = regmem_chunk(&region, 0)->rkey;
+	reply.mem_size = buffer_size;
+	reply.page_sizes = page_sizes;
+	reply.max_rd = max_rd;
+	reply.features = features;
+	// old clients get the old answer
+	if (hello.version)
+	{
+		cm_params.private_data = &reply;
+		cm_params.private_data_len = sizeof(reply);
+	}
+	else
+	{
+		cm_params.private_data = &mr_info;
+		cm_params.private_data_len = sizeof(mr_info);
+	}
+	cm_params.responder_resources = max_rd;
 	cm_params.initiator_depth = 1;
+	cm_params.rnr_retry_count = 7; // pushes may briefly outrun the client's receives
+	next = NULL;
 	if (rdma_accept(conn, &cm_params))
 	{
 		perror("rdma_accept");
-		return 1;
+		goto out;
 	}
 
 	// Get CM event
@@ -230,24 +1226,207 @@ main(int argc, char **argv)
 	if (rdma_get_cm_event(ec, &event))
 	{
 		perror("rdma_get_cm_event");
-		return 1;
+		exit(1);
 	}
-
 	if (event->event != RDMA_CM_EVENT_ESTABLISHED)
 	{
 		fprintf(stderr, "Unexpected event: %s\n", rdma_event_str(event->event));
-		return 1;
+		if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+			next = event;
+		else
+			rdma_ack_cm_event(event);
+		goto out;
 	}
 	rdma_ack_cm_event(event);
+	if (features & FEAT_CTRL)
+		send_region_info();
 
-	// Enter main loop to handle client requests
-	main_loop(client_addr, client_rkey);
+	// Enter main loop to handle client requests; CM events are polled
+	// from it without blocking
+	fcntl(ec->fd, F_SETFL, fcntl(ec->fd, F_GETFL) | O_NONBLOCK);
+	next = main_loop(client_addr, client_rkey);
+	fcntl(ec->fd, F_SETFL, fcntl(ec->fd, F_GETFL) & ~O_NONBLOCK);
+	printf("Client gone (%lu pushes so far), waiting for the next one\n", pushes);
+	if (spin_ns >= 0)
+		printf("Slept on the completion channel %lu times\n", sleeps);
 
+out:
 	// Clean up connection-specific resources
-	ibv_destroy_qp(conn->qp);
-	ibv_dereg_mr(mr);
-	munmap(buffer, buffer_size);
+	if (bulk_conn)
+	{
+		rdma_disconnect(bulk_conn);
+		if (bulk_conn->qp)
+			rdma_destroy_qp(bulk_conn);
+		rdma_destroy_id(bulk_conn);
+	}
+	rdma_disconnect(conn);
+	rdma_destroy_qp(conn);
+	ibv_destroy_cq(cq);
+	if (comp_chan)
+		ibv_destroy_comp_channel(comp_chan);
+	comp_chan = NULL;
 	rdma_destroy_id(conn);
+	conn = NULL;
+	reset_connection();
+	return next;
+}
+
+void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-l host[:port]] [-o] [-H hot_pages] [-f file] [-s file -d dram_pages] [-i] [-w usec]\n", prog);
+	fprintf(stderr, "  -l addr       listen on this address (default %s:%d)\n", DEFAULT_LISTEN, DEFAULT_PORT);
+	fprintf(stderr, "  -o            on-demand-paging MR (falls back to pinned if unsupported)\n");
+	fprintf(stderr, "  -H hot_pages  with -o, prefetch the first hot_pages pages at startup\n");
+	fprintf(stderr, "  -f file       back the region with file (plus file.meta) so pages\n");
+	fprintf(stderr, "                survive a server restart. The file must be on tmpfs, or on\n");
+	fprintf(stderr, "                hugetlbfs for hugepages; with -o it may be on a disk, and\n");
+	fprintf(stderr, "                then pages also survive a reboot\n");
+	fprintf(stderr, "  -s file       tier the region: keep -d pages in DRAM, demote the rest\n");
+	fprintf(stderr, "                to file (local SSD) and promote them on client request\n");
+	fprintf(stderr, "  -d dram_pages DRAM slots for -s\n");
+	fprintf(stderr, "  -g pages      reserve room to grow the region up to pages pages for\n");
+	fprintf(stderr, "                a later client asking for more (not with -f or -s)\n");
+	fprintf(stderr, "  -i            interleave the pool over all NUMA nodes instead of\n");
+	fprintf(stderr, "                placing it on the RDMA device's node\n");
+	fprintf(stderr, "  -w usec       sleep on the completion channel once no completion has\n");
+	fprintf(stderr, "                come for usec (default: busy-poll, lowest latency)\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	char *colon;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:oH:f:s:d:g:iw:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			listen_host = optarg;
+			colon = strrchr(optarg, ':');
+			if (colon)
+			{
+				*colon = '\0';
+				listen_port = atoi(colon + 1);
+			}
+			break;
+		case 'o':
+			odp = 1;
+			break;
+		case 'H':
+			hot_pages = atol(optarg);
+			break;
+		case 'f':
+			backing_path = optarg;
+			break;
+		case 's':
+			tier_path = optarg;
+			break;
+		case 'd':
+			dram_pages = atol(optarg);
+			break;
+		case 'g':
+			grow_pages = atol(optarg);
+			break;
+		case 'i':
+			interleave = 1;
+			break;
+		case 'w':
+			spin_ns = atol(optarg) * 1000;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (tier_path && (backing_path || dram_pages <= 0))
+	{
+		fprintf(stderr, "-s needs -d and cannot be combined with -f\n");
+		return 1;
+	}
+
+	// Initialize server address
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(listen_port);
+	if (listen_port <= 0 || listen_port > 65535 || inet_pton(AF_INET, listen_host, &addr.sin_addr) != 1)
+	{
+		fprintf(stderr, "Bad listen address %s:%d\n", listen_host, listen_port);
+		return 1;
+	}
+
+	// Create event channel
+	printf("Creating event channel...\n");
+	ec = rdma_create_event_channel();
+	if (!ec)
+	{
+		perror("rdma_create_event_channel");
+		return 1;
+	}
+
+	// Create RDMA ID for listening
+	printf("Creating RDMA ID...\n");
+	if (rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP))
+	{
+		perror("rdma_create_id");
+		return 1;
+	}
+
+	// Bind address to RDMA ID
+	printf("Binding address...\n");
+	if (rdma_bind_addr(listener, (struct sockaddr *)&addr))
+	{
+		perror("rdma_bind_addr");
+		return 1;
+	}
+
+	// Start listening for incoming connections
+	printf("Listening...\n");
+	if (rdma_listen(listener, 10))
+	{
+		perror("rdma_listen");
+		return 1;
+	}
+
+	printf("Server is listening at %s:%d\n", listen_host, listen_port);
+
+	// Accept incoming connections and process client requests, one client
+	// at a time; the region stays put between clients
+	struct rdma_cm_event *event = NULL;
+	while (1)
+	{
+		if (!event)
+		{
+			printf("Waiting for connection...\n");
+			if (rdma_get_cm_event(ec, &event))
+			{
+				perror("rdma_get_cm_event");
+				return 1;
+			}
+		}
+		if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST)
+		{
+			// leftovers of a finished connection
+			rdma_ack_cm_event(event);
+			event = NULL;
+			continue;
+		}
+		event = serve_client(event);
+	}
+
+	// Clean up region resources
+	regmem_release(&region);
+	ibv_dereg_mr(ctrl_mr);
+	free(ctrl_buf);
+	if (backing_path)
+		pstore_close(&store);
+	else
+		huge_free(&buffer_mem);
+	if (tier_path)
+		tier_close(&tier);
+	ibv_dealloc_pd(pd);
 
 	// Clean up listener resources
 	rdma_destroy_id(listener);
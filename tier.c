@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "tier.h"
+
+#define TIER_QUEUE_DEPTH 8
+
+// Pages [0, nr_slots) start out resident in the slot of the same index,
+// matching the initial layout the client assumes.
+int
+tier_open(struct tier *t, const char *path, char *dram, size_t page_size,
+          uint32_t nr_pages, uint32_t nr_slots)
+{
+	uint32_t i;
+
+	memset(t, 0, sizeof(*t));
+	t->dram = dram;
+	t->page_size = page_size;
+	t->nr_pages = nr_pages;
+	t->nr_slots = nr_slots < nr_pages ? nr_slots : nr_pages;
+
+	// Slots are page aligned, so O_DIRECT keeps demoted pages out of the
+	// page cache; tmpfs and friends do not support it
+	t->fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0600);
+	if (t->fd < 0 && errno == EINVAL)
+		t->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (t->fd < 0)
+	{
+		perror("open");
+		return -1;
+	}
+	if (ftruncate(t->fd, (off_t)nr_pages * page_size))
+	{
+		perror("ftruncate");
+		goto err;
+	}
+
+	t->page_slot = malloc(nr_pages * sizeof(uint32_t));
+	t->slot_page = malloc(t->nr_slots * sizeof(uint32_t));
+	t->ref = calloc(t->nr_slots, 1);
+	if (!t->page_slot || !t->slot_page || !t->ref)
+	{
+		perror("malloc");
+		goto err;
+	}
+	for (i = 0; i < nr_pages; i++)
+		t->page_slot[i] = i < t->nr_slots ? i : TIER_NONE;
+	for (i = 0; i < t->nr_slots; i++)
+		t->slot_page[i] = i;
+
+	if (uring_init(&t->ring, TIER_QUEUE_DEPTH))
+		goto err;
+	return 0;
+
+err:
+	free(t->page_slot);
+	free(t->slot_page);
+	free(t->ref);
+	close(t->fd);
+	return -1;
+}
+
+// Advance the CLOCK hand to a slot without its reference bit set
+static uint32_t
+pick_victim(struct tier *t)
+{
+	uint32_t slot;
+
+	while (t->ref[t->hand])
+	{
+		t->ref[t->hand] = 0;
+		t->hand = (t->hand + 1) % t->nr_slots;
+	}
+	slot = t->hand;
+	t->hand = (t->hand + 1) % t->nr_slots;
+	return slot;
+}
+
+#define OP_DEMOTE 0
+#define OP_PROMOTE 1
+
+// Make page resident. On return *slot holds it (TIER_NONE on failure) and
+// *victim names the page that was demoted to make room (TIER_NONE if none),
+// which is reported even when the promotion itself fails. The caller must
+// make sure no client is still reading the victim's slot.
+int
+tier_promote(struct tier *t, uint32_t page, uint32_t *slot, uint32_t *victim)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	uint32_t target, old;
+	char *dst;
+	int nr_ops = 0, done = 0;
+	int demote_ok = 1, promote_ok = 0;
+
+	*slot = TIER_NONE;
+	*victim = TIER_NONE;
+	if (page >= t->nr_pages)
+		return -1;
+	if (t->page_slot[page] != TIER_NONE)
+	{
+		*slot = t->page_slot[page];
+		t->ref[*slot] = 1;
+		return 0;
+	}
+
+	target = pick_victim(t);
+	old = t->slot_page[target];
+	dst = t->dram + (size_t)target * t->page_size;
+
+	// Write the old page out before the slot is overwritten
+	if (old != TIER_NONE)
+	{
+		sqe = uring_get_sqe(&t->ring);
+		uring_prep_rw(sqe, IORING_OP_WRITE, t->fd, dst, t->page_size,
+		              (uint64_t)old * t->page_size, OP_DEMOTE);
+		sqe->flags |= IOSQE_IO_LINK;
+		nr_ops++;
+	}
+	sqe = uring_get_sqe(&t->ring);
+	uring_prep_rw(sqe, IORING_OP_READ, t->fd, dst, t->page_size,
+	              (uint64_t)page * t->page_size, OP_PROMOTE);
+	nr_ops++;
+
+	if (uring_submit(&t->ring, nr_ops) < 0)
+		return -1;
+	while (done < nr_ops)
+	{
+		if (!uring_reap(&t->ring, &cqe))
+		{
+			uring_submit(&t->ring, nr_ops - done);
+			continue;
+		}
+		if (cqe.res != (int)t->page_size)
+			fprintf(stderr, "tier %s of page %u failed: %d\n",
+			        cqe.user_data == OP_DEMOTE ? "demotion" : "promotion",
+			        cqe.user_data == OP_DEMOTE ? old : page, cqe.res);
+		if (cqe.user_data == OP_DEMOTE)
+			demote_ok = cqe.res == (int)t->page_size;
+		else
+			promote_ok = cqe.res == (int)t->page_size;
+		done++;
+	}
+
+	// A failed demotion cancels the linked read, so the old page is intact
+	if (!demote_ok)
+		return -1;
+	if (old != TIER_NONE)
+	{
+		t->page_slot[old] = TIER_NONE;
+		t->demotions++;
+		*victim = old;
+	}
+	t->slot_page[target] = TIER_NONE;
+	if (!promote_ok)
+		return -1;
+
+	t->page_slot[page] = target;
+	t->slot_page[target] = page;
+	t->ref[target] = 1;
+	t->promotions++;
+	*slot = target;
+	return 0;
+}
+
+// Mark a resident page as recently used so CLOCK passes over it
+void
+tier_touch(struct tier *t, uint32_t page)
+{
+	if (page < t->nr_pages && t->page_slot[page] != TIER_NONE)
+		t->ref[t->page_slot[page]] = 1;
+}
+
+void
+tier_close(struct tier *t)
+{
+	uring_exit(&t->ring);
+	free(t->page_slot);
+	free(t->slot_page);
+	free(t->ref);
+	close(t->fd);
+}
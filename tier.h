@@ -0,0 +1,36 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "uring.h"
+
+#define TIER_NONE UINT32_MAX
+
+// Remote pages split between a fixed pool of registered DRAM slots and a
+// backing file on local storage. Clients read resident pages one-sided from
+// their slot; a page that is not resident is promoted on request, demoting
+// the CLOCK victim to the file in the same io_uring submission.
+struct tier
+{
+	int fd;
+	char *dram;
+	size_t page_size;
+	uint32_t nr_pages;
+	uint32_t nr_slots;
+	uint32_t *page_slot; // TIER_NONE when the page lives in the file
+	uint32_t *slot_page; // TIER_NONE when the slot is free
+	uint8_t *ref;        // CLOCK reference bit per slot
+	uint32_t hand;
+	struct uring ring;
+	uint64_t promotions;
+	uint64_t demotions;
+};
+
+int tier_open(struct tier *t, const char *path, char *dram, size_t page_size,
+              uint32_t nr_pages, uint32_t nr_slots);
+int tier_promote(struct tier *t, uint32_t page, uint32_t *slot, uint32_t *victim);
+void tier_touch(struct tier *t, uint32_t page);
+void tier_close(struct tier *t);
+
+#endif
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "topology.h"
+
+// from <numaif.h>, which needs libnuma headers
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MAX_NODES 64
+
+static int
+read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f))
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+// Parse a sysfs list such as "0-3,8,10-11" into a bitmask, calling set()
+static int
+parse_list(const char *list, void (*set)(int, void *), void *arg)
+{
+	const char *p = list;
+	char *end;
+	long lo, hi;
+
+	while (*p)
+	{
+		lo = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		hi = lo;
+		if (*end == '-')
+		{
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+		}
+		for (; lo <= hi; lo++)
+			set((int)lo, arg);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+static void
+set_cpu(int cpu, void *arg)
+{
+	if (cpu < CPU_SETSIZE)
+		CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+static void
+set_node(int node, void *arg)
+{
+	if (node < MAX_NODES)
+		*(unsigned long *)arg |= 1UL << node;
+}
+
+// NUMA node the device's PCI function is attached to
+int
+topo_device_node(struct ibv_context *ctx)
+{
+	char path[512], buf[32];
+
+	snprintf(path, sizeof(path), "%s/device/numa_node", ctx->device->ibdev_path);
+	if (read_line(path, buf, sizeof(buf)))
+		return -1;
+	return atoi(buf); // the kernel reports -1 when it does not know
+}
+
+static int
+topo_node_cpus(int node, cpu_set_t *cpus)
+{
+	char path[128], buf[4096];
+
+	CPU_ZERO(cpus);
+	if (node < 0)
+		return -1;
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (read_line(path, buf, sizeof(buf)) || parse_list(buf, set_cpu, cpus))
+		return -1;
+	return CPU_COUNT(cpus) ? 0 : -1;
+}
+
+int
+topo_node_cpu_count(int node)
+{
+	cpu_set_t cpus;
+
+	return topo_node_cpus(node, &cpus) ? 0 : CPU_COUNT(&cpus);
+}
+
+static long
+sys_mbind(void *addr, size_t len, int mode, unsigned long *nodemask)
+{
+	return syscall(SYS_mbind, addr, len, mode, nodemask, MAX_NODES + 1, 0);
+}
+
+// Prefer node for pages of [addr, addr + len) that are not faulted in yet
+int
+topo_bind_memory(void *addr, size_t len, int node)
+{
+	unsigned long mask;
+
+	if (node < 0 || node >= MAX_NODES)
+		return -1;
+	mask = 1UL << node;
+	if (sys_mbind(addr, len, MPOL_PREFERRED, &mask))
+	{
+		perror("mbind");
+		return -1;
+	}
+	return 0;
+}
+
+// Spread [addr, addr + len) over all online nodes
+int
+topo_interleave_memory(void *addr, size_t len)
+{
+	char buf[256];
+	unsigned long mask = 0;
+
+	if (read_line("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+	    parse_list(buf, set_node, &mask) || !(mask & (mask - 1)))
+		return -1; // unknown or a single node
+	if (sys_mbind(addr, len, MPOL_INTERLEAVE, &mask))
+	{
+		perror("mbind");
+		return -1;
+	}
+	return 0;
+}
+
+int
+topo_pin_thread(pthread_t thread, int node)
+{
+	cpu_set_t cpus;
+
+	if (topo_node_cpus(node, &cpus))
+		return -1;
+	if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus))
+	{
+		perror("pthread_setaffinity_np");
+		return -1;
+	}
+	return 0;
+}
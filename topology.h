@@ -0,0 +1,19 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+// NUMA placement relative to the RDMA device. Calls return -1 and change
+// nothing when sysfs does not report the node (topo_device_node() gives -1
+// then), and topo_interleave_memory() also when only one node is online.
+// On a single-node machine the rest succeed, binding to and pinning within
+// that one node, which has no effect.
+int topo_device_node(struct ibv_context *ctx);
+int topo_node_cpu_count(int node);
+int topo_bind_memory(void *addr, size_t len, int node);
+int topo_interleave_memory(void *addr, size_t len);
+int topo_pin_thread(pthread_t thread, int node);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal io_uring wrapper on the raw syscalls (no liburing dependency)
+struct uring
+{
+	int fd;
+	unsigned entries;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_pending; // sqes filled in but not yet submitted
+
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *addr,
+                   unsigned len, uint64_t offset, uint64_t user_data);
+int uring_submit(struct uring *ring, unsigned wait_nr);
+int uring_reap(struct uring *ring, struct io_uring_cqe *cqe);
+void uring_exit(struct uring *ring);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "workload.h"
+
+uint64_t
+wl_rand(struct workload *wl)
+{
+	wl->rng ^= wl->rng >> 12;
+	wl->rng ^= wl->rng << 25;
+	wl->rng ^= wl->rng >> 27;
+	return wl->rng * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, n)
+static uint64_t
+rand_below(struct workload *wl, uint64_t n)
+{
+	return wl_rand(wl) % n;
+}
+
+// Random permutation of the pages (Fisher-Yates), or with cycle set a
+// single cycle through all of them (Sattolo), read as "page after page"
+static uint64_t *
+shuffle(struct workload *wl, int cycle)
+{
+	uint64_t *perm, i, j, t;
+
+	perm = malloc(wl->nr_pages * sizeof(*perm));
+	if (!perm)
+	{
+		perror("malloc");
+		return NULL;
+	}
+	for (i = 0; i < wl->nr_pages; i++)
+		perm[i] = i;
+	for (i = wl->nr_pages - 1; i > 0; i--)
+	{
+		j = cycle ? rand_below(wl, i) : rand_below(wl, i + 1);
+		t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+	return perm;
+}
+
+// Cumulative popularity of the ranks, rank r weighted 1 / (r + 1)^s
+static int
+zipf_setup(struct workload *wl, double s)
+{
+	double sum = 0;
+	uint64_t r;
+
+	wl->zipf_cdf = malloc(wl->nr_pages * sizeof(*wl->zipf_cdf));
+	wl->perm = shuffle(wl, 0);
+	if (!wl->zipf_cdf || !wl->perm)
+	{
+		perror("malloc");
+		return -1;
+	}
+	for (r = 0; r < wl->nr_pages; r++)
+	{
+		sum += 1.0 / pow(r + 1, s);
+		wl->zipf_cdf[r] = sum;
+	}
+	for (r = 0; r < wl->nr_pages; r++)
+		wl->zipf_cdf[r] /= sum;
+	return 0;
+}
+
+static uint64_t
+zipf_next(struct workload *wl)
+{
+	double u = (wl_rand(wl) >> 11) * (1.0 / (1ULL << 53));
+	uint64_t lo = 0, hi = wl->nr_pages - 1, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (wl->zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return wl->perm[lo];
+}
+
+// Parse spec (see workload.h) for a range of nr_pages pages. -1 if it
+// names no pattern or its parameters do not fit the range.
+int
+wl_init(struct workload *wl, const char *spec, uint64_t nr_pages, uint64_t seed)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? (size_t)(arg - spec) : strlen(spec);
+	double s = 0.99;
+	long a = 0, b = 0;
+
+	memset(wl, 0, sizeof(*wl));
+	wl->nr_pages = nr_pages;
+	wl->rng = seed ? seed : 1;
+	if (arg)
+		arg++;
+	if (!nr_pages)
+		return -1;
+
+	if (len == 3 && !strncmp(spec, "seq", len))
+	{
+		wl->pattern = WL_SEQ;
+		wl->stride = 1;
+	}
+	else if (len == 6 && !strncmp(spec, "stride", len))
+	{
+		wl->pattern = WL_STRIDE;
+		if (!arg || (a = atol(arg)) < 1)
+			return -1;
+		wl->stride = a;
+	}
+	else if (len == 6 && !strncmp(spec, "random", len))
+	{
+		wl->pattern = WL_RANDOM;
+	}
+	else if (len == 4 && !strncmp(spec, "zipf", len))
+	{
+		wl->pattern = WL_ZIPF;
+		if (arg && (s = atof(arg)) <= 0)
+			return -1;
+		if (zipf_setup(wl, s))
+			return -1;
+	}
+	else if (len == 5 && !strncmp(spec, "chase", len))
+	{
+		wl->pattern = WL_CHASE;
+		wl->dependent = 1;
+		wl->perm = shuffle(wl, 1);
+		if (!wl->perm)
+			return -1;
+	}
+	else if (len == 5 && !strncmp(spec, "phase", len))
+	{
+		wl->pattern = WL_PHASE;
+		if (arg && sscanf(arg, "%ld,%ld", &a, &b) < 1)
+			return -1;
+		wl->ws_pages = a > 0 ? (uint64_t)a : (nr_pages + 7) / 8;
+		wl->phase_len = b > 0 ? (uint64_t)b : 10000;
+		if (wl->ws_pages > nr_pages)
+			return -1;
+	}
+	else
+	{
+		return -1;
+	}
+	// seq and stride start at page 0
+	wl->pos = -wl->stride;
+	return 0;
+}
+
+// Page of the next fault
+uint64_t
+wl_next(struct workload *wl)
+{
+	switch (wl->pattern)
+	{
+	case WL_SEQ:
+	case WL_STRIDE:
+		wl->pos = (wl->pos + wl->stride) % wl->nr_pages;
+		return wl->pos;
+	case WL_RANDOM:
+		return rand_below(wl, wl->nr_pages);
+	case WL_ZIPF:
+		return zipf_next(wl);
+	case WL_CHASE:
+		wl->pos = wl->perm[wl->pos];
+		return wl->pos;
+	case WL_PHASE:
+		if (!wl->phase_left)
+		{
+			wl->phase_base = rand_below(wl, wl->nr_pages);
+			wl->phase_left = wl->phase_len;
+		}
+		wl->phase_left--;
+		return (wl->phase_base + rand_below(wl, wl->ws_pages)) % wl->nr_pages;
+	}
+	return 0;
+}
+
+void
+wl_free(struct workload *wl)
+{
+	free(wl->zipf_cdf);
+	free(wl->perm);
+}
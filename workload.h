@@ -0,0 +1,49 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+
+// Synthetic fault streams for queue_tester: which page each fault of a run
+// touches, from a pattern spec:
+//   seq            pages in order, wrapping around
+//   stride:n       every n-th page, wrapping around
+//   random         uniform over all pages
+//   zipf[:s]       Zipfian with exponent s (default 0.99); the hot pages
+//                  are scattered over the range
+//   chase          a pointer chase through a random cycle over all pages;
+//                  each fault depends on the one before
+//   phase[:w[,l]]  uniform over a working set of w pages (default an
+//                  eighth) that moves to another part of the range every
+//                  l faults (default 10000)
+enum wl_pattern
+{
+	WL_SEQ,
+	WL_STRIDE,
+	WL_RANDOM,
+	WL_ZIPF,
+	WL_CHASE,
+	WL_PHASE,
+};
+
+struct workload
+{
+	enum wl_pattern pattern;
+	uint64_t nr_pages;
+	uint64_t rng; // xorshift64* state
+	uint64_t pos; // seq, stride, chase: the page last returned
+	uint64_t stride;
+	double *zipf_cdf;  // by popularity rank
+	uint64_t *perm;    // zipf: page of each rank; chase: page after each page
+	uint64_t ws_pages; // phase: working set size
+	uint64_t phase_len;
+	uint64_t phase_base;
+	uint64_t phase_left;
+	int dependent; // a fault is only raised once the one before is handled
+};
+
+int wl_init(struct workload *wl, const char *spec, uint64_t nr_pages, uint64_t seed);
+uint64_t wl_next(struct workload *wl);
+uint64_t wl_rand(struct workload *wl);
+void wl_free(struct workload *wl);
+
+#endif